@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include "admission.h"
+#include "config.h"
+
+/* Headroom left to other processes of the user: a run using the last pid
+ * would starve the shell it runs from */
+#define ADMISSION_MARGIN(headroom) ((headroom) / 16)
+
+/* Threads of the real user, which is what RLIMIT_NPROC counts */
+static long user_threads(void) {
+    DIR* proc = opendir("/proc");
+    struct dirent* entry;
+    long threads = 0;
+    uid_t uid = getuid();
+
+    if (proc == NULL) {
+        perror("opendir /proc");
+        return -1;
+    }
+
+    while ((entry = readdir(proc)) != NULL) {
+        char path[PATH_MAX];
+        char line[256];
+        unsigned int real_uid = 0;
+        long count = 0;
+        int is_user = 0;
+
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/status", entry->d_name);
+        FILE* f = fopen(path, "r");
+        if (f == NULL) {
+            continue; /* exited meanwhile */
+        }
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "Uid: %u", &real_uid) == 1) {
+                is_user = real_uid == uid;
+            } else if (sscanf(line, "Threads: %ld", &count) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+
+        if (is_user) {
+            threads += count;
+        }
+    }
+    closedir(proc);
+    return threads;
+}
+
+/* Processes the user can still start under RLIMIT_NPROC, or -1 if the
+ * limit does not apply */
+static long nproc_headroom(void) {
+    struct rlimit limit;
+
+    /* Not enforced for root */
+    if (geteuid() == 0 || getrlimit(RLIMIT_NPROC, &limit) == -1 ||
+        limit.rlim_cur == RLIM_INFINITY) {
+        return -1;
+    }
+
+    long used = user_threads();
+    if (used == -1) {
+        return -1;
+    }
+    return (long)limit.rlim_cur > used ? (long)limit.rlim_cur - used : 0;
+}
+
+/* Read the first number of a file; "max" and errors give -1 */
+static long read_number(const char* path) {
+    long value = -1;
+    FILE* f = fopen(path, "r");
+
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &value) != 1) {
+            value = -1;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+/* Processes the cgroup (v2) of the master can still start under its
+ * pids.max, or -1 without a limit */
+static long cgroup_headroom(void) {
+    char line[PATH_MAX];
+    char path[PATH_MAX + 64];
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    long headroom = -1;
+
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::", 3) != 0) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/pids.max", line + 3);
+        long max = read_number(path);
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/pids.current", line + 3);
+        long current = read_number(path);
+        if (max != -1 && current != -1) {
+            headroom = max > current ? max - current : 0;
+        }
+        break;
+    }
+    fclose(f);
+    return headroom;
+}
+
+static long min_limit(long budget, long headroom) {
+    if (headroom == -1) {
+        return budget;
+    }
+    headroom -= ADMISSION_MARGIN(headroom);
+    return headroom < budget ? headroom : budget;
+}
+
+void admission_init(Statistics* stats) {
+    long nproc = nproc_headroom();
+    long cgroup = cgroup_headroom();
+    long budget = config.process_budget > 0 ? config.process_budget : LONG_MAX;
+
+    budget = min_limit(budget, nproc);
+    budget = min_limit(budget, cgroup);
+
+    atomic_store(&stats->admission.processes, 0);
+    stats->admission.budget = budget;
+    stats->admission.inject_limit = budget == LONG_MAX ? LONG_MAX : budget - budget / 10;
+
+    if (budget == LONG_MAX) {
+        printf("Process budget: unlimited\n");
+    } else {
+        printf("Process budget: %ld (RLIMIT_NPROC headroom: %ld, pids.max headroom: %ld, PROCESS_BUDGET: %d)\n",
+               budget, nproc, cgroup, config.process_budget);
+    }
+}
+
+int admission_reserve(Statistics* stats, int kind) {
+    Admission* admission = &stats->admission;
+    long limit = kind == ADMIT_INJECT ? admission->inject_limit : admission->budget;
+
+    long processes = atomic_fetch_add(&admission->processes, 1);
+    if (kind != ADMIT_HELPER && processes >= limit) {
+        atomic_fetch_sub(&admission->processes, 1);
+        return -1;
+    }
+    return 0;
+}
+
+int admission_wait(Statistics* stats, int kind, long deadline_ns) {
+    Admission* admission = &stats->admission;
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000L,
+        .tv_nsec = deadline_ns % 1000000000L,
+    };
+
+    while (1) {
+        /* Read the generation before trying: a release in between changes
+         * it, so the futex_wait below cannot miss it */
+        unsigned int seen = atomic_load(&admission->released);
+
+        if (!is_running(stats)) {
+            return -1;
+        }
+        if (admission_reserve(stats, kind) == 0) {
+            return 0;
+        }
+
+        atomic_fetch_add(&admission->waiters, 1);
+        int timed_out = futex_wait(&admission->released, seen, &deadline) == -1 && errno == ETIMEDOUT;
+        atomic_fetch_sub(&admission->waiters, 1);
+        if (timed_out) {
+            return -1;
+        }
+    }
+}
+
+void admission_release(Statistics* stats) {
+    Admission* admission = &stats->admission;
+
+    atomic_fetch_sub(&admission->processes, 1);
+
+    /* One process was released: one waiting split can take it */
+    atomic_fetch_add(&admission->released, 1);
+    if (atomic_load(&admission->waiters) > 0) {
+        futex_wake(&admission->released, 1);
+    }
+}
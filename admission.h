@@ -0,0 +1,44 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "shared.h"
+
+/*
+ * Fork admission control.
+ *
+ * Every fork of the run first reserves a process in stats->admission,
+ * and the reservation is released when the process is reaped. The master
+ * sets the budget from the headroom under RLIMIT_NPROC and the cgroup
+ * pids.max, and from PROCESS_BUDGET. New atoms stop short of the budget,
+ * so the room left near the limit goes to splits. A split that would
+ * exceed the budget waits up to ADMISSION_WAIT_NS for a process to be
+ * released; after that it is refused and the atom lives on unsplit. The
+ * fork that fails anyway still means MELTDOWN.
+ */
+
+/* Longest wait of a split for a released process: one activator tick */
+#define ADMISSION_WAIT_NS 100000000L
+
+/* Kinds of fork, from the one admitted last to the one always admitted */
+enum {
+    ADMIT_INJECT,               /* New atom of the master, alimentazione or the pool */
+    ADMIT_SPLIT,                /* Atom split */
+    ADMIT_HELPER                /* attivatore and alimentazione, always admitted */
+};
+
+/* Set the budget; called by the master before its first fork */
+void admission_init(Statistics* stats);
+
+/* Reserve a process before a fork. Returns 0 if admitted, -1 if the
+ * budget has no room for this kind of fork. */
+int admission_reserve(Statistics* stats, int kind);
+
+/* Reserve a process, sleeping until one is released while the budget has
+ * no room. Returns 0 if admitted, -1 if the absolute CLOCK_MONOTONIC
+ * deadline passed or the simulation stopped first. */
+int admission_wait(Statistics* stats, int kind, long deadline_ns);
+
+/* Give back a reservation: the process was reaped or the fork failed */
+void admission_release(Statistics* stats);
+
+#endif
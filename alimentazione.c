@@ -4,11 +4,16 @@
 #include <time.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <pthread.h>
 #include "shared.h"
 #include "config.h"
+#include "atomo_core.h"
+#include "admission.h"
+#include "rng.h"
 
 static int shm_id, sem_id, msg_id;
 static Statistics* stats;
+static Rng rng;
 
 void cleanup(void) {
     if (stats != NULL) {
@@ -16,12 +21,29 @@ void cleanup(void) {
     }
 }
 
-/* Create a new atom process */
-int create_atom(int atomic_number) {
+/* Start an atom process (atomic number 0 joins the pool): a plain fork
+ * running the linked-in atom body, or fork and exec of ./atomo. Returns 0
+ * when started, 1 when admission control defers it, -1 if fork failed. */
+int spawn_atom(int atomic_number) {
+    if (admission_reserve(stats, ADMIT_INJECT) == -1) {
+        return 1;
+    }
+
+    if (config.spawn_mode == SPAWN_FORK) {
+        if (fork_atom(stats, sem_id, msg_id, atomic_number) == -1) {
+            perror("fork failed in alimentazione");
+            admission_release(stats);
+            return -1;
+        }
+        return 0;
+    }
+
+    long start = monotonic_ns();
     pid_t pid = fork();
 
     if (pid == -1) {
         perror("fork failed in alimentazione");
+        admission_release(stats);
         return -1;
     } else if (pid == 0) {
         /* Child process - exec atomo */
@@ -37,9 +59,52 @@ int create_atom(int atomic_number) {
     }
 
     /* Parent */
+    stats_record(stats, OP_FORK, monotonic_ns() - start);
     return 0;
 }
 
+/* Create a new atom: hand it to an idle atom of the pool if there is one,
+ * otherwise spawn a process (or hand it to the in-process engine).
+ * Returns like spawn_atom. */
+int create_atom(int atomic_number) {
+    if (config.engine_threads > 0) {
+        return send_message(msg_id, MSG_NEW_ATOM, 0, atomic_number);
+    }
+
+    if (config.atom_pool_size > 0 && pool_assign(stats, atomic_number) == 0) {
+        return 0;
+    }
+
+    return spawn_atom(atomic_number);
+}
+
+/* Keep ATOM_POOL_SIZE idle atoms forked, off the injection path */
+void* refill_pool(void* arg) {
+    int missing;
+    (void)arg;
+
+    while ((missing = pool_wait_refill(stats, config.atom_pool_size)) > 0) {
+        for (int i = 0; i < missing; i++) {
+            int result = spawn_atom(0);
+            if (result == -1) {
+                /* Fork failed - signal meltdown */
+                stop_simulation(stats, TERM_MELTDOWN);
+                return NULL;
+            }
+            if (result == 1) {
+                /* No room for idle atoms now; try again after a step */
+                if (!sleep_while_running(stats, config.step)) {
+                    return NULL;
+                }
+                break;
+            }
+            pool_spawned(stats, 1);
+        }
+    }
+
+    return NULL;
+}
+
 int main(int argc, char* argv[]) {
     if (argc != 4) {
         fprintf(stderr, "Usage: %s <shm_id> <sem_id> <msg_id>\n", argv[0]);
@@ -59,71 +124,69 @@ int main(int argc, char* argv[]) {
     /* Register cleanup */
     atexit(cleanup);
 
+    /* Reap the atoms it forks as they exit */
+    if (install_reaper(stats) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
     /* Load configuration */
     load_config();
+    set_message_transport(stats, config.transport);
 
     /* Signal initialization complete */
-    sem_wait_op(sem_id, SEM_STATS);
-    stats->init_count++;
-    sem_signal_op(sem_id, SEM_STATS);
+    signal_init_done(stats);
 
     /* Seed random number generator */
-    srand(time(NULL) ^ getpid());
+    rng_seed(&rng, config.seed, RNG_STREAM_ALIMENTAZIONE);
 
-    /* Wait for simulation to start */
-    while (1) {
-        sem_wait_op(sem_id, SEM_STATS);
-        int running = stats->running;
-        sem_signal_op(sem_id, SEM_STATS);
-
-        if (running) {
-            break;
-        }
-
-        usleep(10000); /* 10ms */
+    /* Start refilling the pool the initial atoms were taken from */
+    pthread_t refiller;
+    if (config.atom_pool_size > 0 &&
+        pthread_create(&refiller, NULL, refill_pool, NULL) != 0) {
+        fprintf(stderr, "Failed to start the pool refiller\n");
+        exit(EXIT_FAILURE);
     }
 
-    /* Main loop - add new atoms periodically */
-    struct timespec sleep_time;
-    sleep_time.tv_sec = config.step / 1000000000;
-    sleep_time.tv_nsec = config.step % 1000000000;
-
-    while (1) {
-        /* Check if simulation is still running */
-        sem_wait_op(sem_id, SEM_STATS);
-        int running = stats->running;
-        sem_signal_op(sem_id, SEM_STATS);
+    /* Wait for simulation to start */
+    wait_for_start(stats);
+
+    /* Main loop - add new atoms every STEP, on deadlines fixed from the
+     * start so the time spent forking does not stretch the period */
+    int backlog = 0; /* atoms deferred by admission control, created first */
+    int periods;
+    Schedule schedule;
+    schedule_start(&schedule, config.step);
+
+    /* Sleep first, waking up at once if the simulation stops */
+    while ((periods = schedule_wait(stats, &schedule)) > 0) {
+        /* Create new atoms until admission control defers the rest */
+        int due = backlog + periods * config.n_nuovi_atomi;
+        int created = 0;
+        int result = 0;
+        while (created < due) {
+            /* Random atomic number between 1 and N_ATOM_MAX */
+            int atomic_number = rng_range(&rng, config.n_atom_max) + 1;
 
-        if (!running) {
-            break;
+            result = create_atom(atomic_number);
+            if (result != 0) {
+                break;
+            }
+            created++;
         }
 
-        /* Sleep first */
-        nanosleep(&sleep_time, NULL);
-
-        /* Check again after sleep */
-        sem_wait_op(sem_id, SEM_STATS);
-        running = stats->running;
-        sem_signal_op(sem_id, SEM_STATS);
-
-        if (!running) {
+        if (result == -1) {
+            /* Fork failed - signal meltdown */
+            stop_simulation(stats, TERM_MELTDOWN);
             break;
         }
 
-        /* Create new atoms */
-        for (int i = 0; i < config.n_nuovi_atomi; i++) {
-            /* Random atomic number between 1 and N_ATOM_MAX */
-            int atomic_number = (rand() % config.n_atom_max) + 1;
-
-            if (create_atom(atomic_number) != 0) {
-                /* Fork failed - signal meltdown */
-                sem_wait_op(sem_id, SEM_STATS);
-                stats->termination_cause = TERM_MELTDOWN;
-                stats->running = 0;
-                sem_signal_op(sem_id, SEM_STATS);
-                break;
-            }
+        /* Count each atom once, when it is first deferred */
+        int deferred = due - created;
+        if (deferred > backlog) {
+            update_stats_deferred_atoms(stats, deferred - backlog);
         }
+        backlog = deferred;
+        atomic_store(&stats->admission.backlog, backlog);
     }
 
     return 0;
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include "atomo_core.h"
+#include "config.h"
+#include "admission.h"
+
+static int sem_id, msg_id;
+static Statistics* stats;
+static int atomic_number;
+static AtomSlot* slot; /* Our entry in the atom table, NULL if it was full */
+static int exit_status;
+static int owed; /* activations of a batch the queue had no room for */
+
+/* Register the calling process in the atom table */
+static void claim_slot(void) {
+    slot = atom_table_claim(stats, getpid(), atomic_number);
+    if (slot == NULL && config.activation_target != TARGET_ANY) {
+        fprintf(stderr, "atomo %d: atom table full, cannot be targeted\n", getpid());
+    }
+}
+
+/* Split the atom. Returns 0 if the atom is gone (waste or meltdown), -1
+ * if the process budget refused the split and the atom stays whole, 1
+ * otherwise. */
+static int split_atom(void) {
+    if (atomic_number <= config.min_n_atomico) {
+        /* Atom becomes waste; cleanup records its death */
+        update_stats_waste(stats);
+        return 0;
+    }
+
+    /* At the process budget the split waits a bounded time for a process
+     * to be reaped. The atom takes no more activations meanwhile, so they
+     * go to atoms that can still become waste; if nothing is released the
+     * split is refused, so the atoms never all wait on each other. */
+    if (admission_reserve(stats, ADMIT_SPLIT) == -1 &&
+        admission_wait(stats, ADMIT_SPLIT, monotonic_ns() + ADMISSION_WAIT_NS) == -1) {
+        update_stats_refused_split(stats);
+        return -1;
+    }
+
+    /* Calculate split - try to split evenly for maximum energy */
+    int n1, n2;
+    if (atomic_number % 2 == 0) {
+        n1 = atomic_number / 2;
+        n2 = atomic_number / 2;
+    } else {
+        n1 = atomic_number / 2;
+        n2 = atomic_number / 2 + 1;
+    }
+
+    /* Calculate energy before fork */
+    long energy = calculate_energy(n1, n2);
+
+    if (slot != NULL) {
+        atomic_store(&slot->state, ATOM_SPLITTING);
+    }
+
+    /* Fork new atom */
+    long fork_start = monotonic_ns();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        /* Fork failed - meltdown */
+        perror("fork failed in atomo");
+        admission_release(stats);
+        stop_simulation(stats, TERM_MELTDOWN);
+        exit_status = EXIT_FAILURE;
+        return 0;
+    } else if (pid == 0) {
+        /* Child process - new atom; the activations still owed are the
+         * parent's */
+        atomic_number = n2;
+        owed = 0;
+        stats_bind_writer();
+        claim_slot();
+        stats_atom_born(stats, atomic_number);
+    } else {
+        /* Parent process */
+        stats_record(stats, OP_FORK, monotonic_ns() - fork_start);
+        stats_atom_split(stats, atomic_number, n1);
+        atomic_number = n1;
+        if (slot != NULL) {
+            atom_table_renumber(stats, slot, atomic_number);
+            atomic_store(&slot->state, ATOM_WAITING);
+        }
+
+        /* Update statistics (once per fission, not in both halves) */
+        update_stats_split(stats);
+        update_stats_energy(stats, energy);
+    }
+    return 1;
+}
+
+/* Keep one activation of the batch and hand the rest back to the queue in
+ * two halves, so a batch of N reaches N atoms in about log2(N) hops. The
+ * atoms are the readers of the queue, so an atom never waits for room in
+ * it: a half the queue has no room for is owed by the atom itself. */
+static void forward_activations(const Message* msg) {
+    int remaining = MSG_ACTIVATIONS(msg) - 1;
+    int half = remaining / 2;
+
+    owed = 1;
+    if (half > 0 && forward_message(msg_id, msg, half) == -1) {
+        owed += half;
+    }
+    if (remaining - half > 0 && forward_message(msg_id, msg, remaining - half) == -1) {
+        owed += remaining - half;
+    }
+}
+
+static void cleanup(void) {
+    if (slot != NULL) {
+        atom_table_release(stats, slot);
+    }
+
+    stats_atom_died(stats, atomic_number);
+}
+
+int atom_main(Statistics* shared_stats, int shared_sem_id, int shared_msg_id, int initial_number) {
+    stats = shared_stats;
+    sem_id = shared_sem_id;
+    msg_id = shared_msg_id;
+    atomic_number = initial_number;
+    slot = NULL;
+    exit_status = EXIT_SUCCESS;
+
+    stats_bind_writer();
+
+    /* Reap the atoms split off from this one as they exit */
+    install_reaper(stats);
+
+    /* Pool member: stay idle until somebody hands us an atomic number */
+    if (atomic_number == 0) {
+        atomic_number = pool_wait_assignment(stats);
+        if (atomic_number == 0) {
+            return EXIT_SUCCESS;
+        }
+    }
+
+    stats_atom_born(stats, atomic_number);
+
+    /* Register in the atom table */
+    claim_slot();
+
+    /* Signal initialization complete */
+    signal_init_done(stats);
+
+    /* Wait for simulation to start */
+    wait_for_start(stats);
+
+    int alive = 1;
+
+    /* Main loop - wait for activations targeted at this atom. The slot is
+     * checked on every activation: a child split off while the table was
+     * full has none, and goes on in the queue loop like an atom that found
+     * the table full at birth. */
+    while (config.activation_target != TARGET_ANY && slot != NULL) {
+        if (!wait_for_activation(stats, slot) || split_atom() == 0) {
+            alive = 0;
+            break;
+        }
+    }
+
+    /* Main loop - wait for split messages for any atom */
+    while (alive && is_running(stats)) {
+        Message msg;
+
+        /* Try to receive split message */
+        if (receive_message(msg_id, &msg, MSG_SPLIT) == 0) {
+            int split = 1;
+
+            forward_activations(&msg);
+            while (owed > 0 && split == 1 && is_running(stats)) {
+                owed--;
+                record_activation_latency(stats, msg.sent_ns);
+                split = split_atom();
+            }
+            if (split == -1) {
+                owed++; /* a refused activation is given back */
+            }
+            if (split != 1 && owed > 0) {
+                /* What the atom gave back or still owes goes back to the
+                 * queue if it has room by now */
+                forward_message(msg_id, &msg, owed);
+                owed = 0;
+            }
+            if (split == 0) {
+                break;
+            }
+        } else if (errno == EIDRM || errno == EINVAL) {
+            /* Queue removed by the master at shutdown */
+            break;
+        }
+    }
+
+    cleanup();
+    return exit_status;
+}
+
+pid_t fork_atom(Statistics* shared_stats, int shared_sem_id, int shared_msg_id, int initial_number) {
+    long start = monotonic_ns();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        /* Atoms die on SIGTERM like an exec'd atomo, whatever the spawner
+         * installed */
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        prctl(PR_SET_NAME, "atomo");
+        _exit(atom_main(shared_stats, shared_sem_id, shared_msg_id, initial_number));
+    }
+    if (pid > 0) {
+        stats_record(shared_stats, OP_FORK, monotonic_ns() - start);
+    }
+    return pid;
+}
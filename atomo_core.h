@@ -0,0 +1,23 @@
+#ifndef ATOMO_CORE_H
+#define ATOMO_CORE_H
+
+#include <sys/types.h>
+#include "shared.h"
+
+/*
+ * Body of an atom process, linked both into atomo and into the spawners so
+ * that an atom can be started with a plain fork (SPAWN_MODE=fork), reusing
+ * the attached segment and the loaded configuration.
+ */
+
+/* Run the atom until it becomes waste or the simulation stops and return
+ * its exit status. Expects the segment attached, the configuration loaded
+ * and the message transport set. Never calls exit(). Atomic number 0
+ * waits in the pool for one to be assigned. */
+int atom_main(Statistics* stats, int sem_id, int msg_id, int atomic_number);
+
+/* Fork a child running atom_main and leaving with _exit(), so that none of
+ * the spawner's atexit handlers run in it. Returns the pid, or -1. */
+pid_t fork_atom(Statistics* stats, int sem_id, int msg_id, int atomic_number);
+
+#endif
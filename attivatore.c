@@ -5,9 +5,127 @@
 #include <signal.h>
 #include "shared.h"
 #include "config.h"
+#include "rng.h"
+#include "controller.h"
 
 static int shm_id, sem_id, msg_id;
 static Statistics* stats;
+static Rng rng;
+
+/* Live atom found by a scan of the atom table */
+typedef struct {
+    AtomSlot* slot;
+    pid_t pid;
+    int atomic_number;
+    long birth;
+} Candidate;
+
+static Candidate candidates[ATOM_TABLE_SIZE];
+
+/* Copy the live entries of the atom table; returns how many */
+static int collect_candidates(void) {
+    int n = 0;
+    int used = atom_table_used(stats);
+
+    for (int i = 0; i < used; i++) {
+        AtomSlot* slot = &stats->atoms[i];
+        pid_t pid = atomic_load_explicit(&slot->pid, memory_order_relaxed);
+
+        if (pid != 0) {
+            candidates[n].slot = slot;
+            candidates[n].pid = pid;
+            candidates[n].atomic_number = atomic_load_explicit(&slot->atomic_number, memory_order_relaxed);
+            candidates[n].birth = slot->birth;
+            n++;
+        }
+    }
+    return n;
+}
+
+static int by_largest(const void* a, const void* b) {
+    return ((const Candidate*)b)->atomic_number - ((const Candidate*)a)->atomic_number;
+}
+
+static int by_oldest(const void* a, const void* b) {
+    long diff = ((const Candidate*)a)->birth - ((const Candidate*)b)->birth;
+    return (diff > 0) - (diff < 0);
+}
+
+/* Deliver the activations of a tick straight to the mailboxes of the atoms
+ * chosen by the policy. One scan of the table per tick; the oldest policy
+ * spreads the activations over the first atoms of the order. Returns the
+ * number of activations delivered. */
+static int activate_targets(int policy, int num_activations) {
+    int n = collect_candidates();
+    int delivered = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (policy == TARGET_RANDOM) {
+        for (int i = 0; i < num_activations; i++) {
+            Candidate* c = &candidates[rng_range(&rng, n)];
+            if (deliver_activations(c->slot, c->pid, 1) == 0) {
+                delivered++;
+            }
+        }
+        return delivered;
+    }
+
+    qsort(candidates, n, sizeof(Candidate), by_oldest);
+
+    for (int i = 0; i < n && i < num_activations; i++) {
+        int count = num_activations / n + (i < num_activations % n ? 1 : 0);
+        if (deliver_activations(candidates[i].slot, candidates[i].pid, count) == 0) {
+            delivered += count;
+        }
+    }
+    return delivered;
+}
+
+/* Largest (most energy per activation) or smallest splitting atoms, taken
+ * from the atom index without a scan of the table; the activations are
+ * spread over them like for the other ordered policies */
+static int activate_by_size(int smallest, int num_activations) {
+    static AtomSlot* targets[ATOM_TABLE_SIZE];
+    int max = num_activations < ATOM_TABLE_SIZE ? num_activations : ATOM_TABLE_SIZE;
+    int n = atom_index_collect(stats, smallest, targets, max);
+    int delivered = 0;
+
+    for (int i = 0; i < n; i++) {
+        int count = num_activations / n + (i < num_activations % n ? 1 : 0);
+        pid_t pid = atomic_load(&targets[i]->pid);
+        if (pid != 0 && deliver_activations(targets[i], pid, count) == 0) {
+            delivered += count;
+        }
+    }
+    return delivered;
+}
+
+/* Controlled targeting: the largest atoms whose split still fits in the
+ * room of the band, until the energy needed is covered. Small atoms are
+ * left for the ticks that only need a little energy. Returns the number
+ * of activations delivered. */
+static int activate_for_energy(long needed, long room) {
+    int n = collect_candidates();
+    int delivered = 0;
+
+    qsort(candidates, n, sizeof(Candidate), by_largest);
+
+    for (int i = 0; i < n && needed > 0; i++) {
+        long yield = activation_yield(candidates[i].atomic_number);
+        if (yield <= 0 || yield > room) {
+            continue;
+        }
+        if (deliver_activations(candidates[i].slot, candidates[i].pid, 1) == 0) {
+            delivered++;
+            needed -= yield;
+            room -= yield;
+        }
+    }
+    return delivered;
+}
 
 void cleanup(void) {
     if (stats != NULL) {
@@ -36,60 +154,65 @@ int main(int argc, char* argv[]) {
 
     /* Load configuration */
     load_config();
+    set_message_transport(stats, config.transport);
 
     /* Signal initialization complete */
-    sem_wait_op(sem_id, SEM_STATS);
-    stats->init_count++;
-    sem_signal_op(sem_id, SEM_STATS);
+    signal_init_done(stats);
 
     /* Seed random number generator */
-    srand(time(NULL) ^ getpid());
+    rng_seed(&rng, config.seed, RNG_STREAM_ATTIVATORE);
 
     /* Wait for simulation to start */
-    while (1) {
-        sem_wait_op(sem_id, SEM_STATS);
-        int running = stats->running;
-        sem_signal_op(sem_id, SEM_STATS);
-
-        if (running) {
-            break;
-        }
-
-        usleep(10000); /* 10ms */
-    }
-
-    /* Main loop - activate atoms periodically */
-    struct timespec sleep_time;
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = 100000000; /* 100ms */
-
-    while (1) {
-        /* Check if simulation is still running */
-        sem_wait_op(sem_id, SEM_STATS);
-        int running = stats->running;
-        int num_atoms = stats->num_atoms;
-        sem_signal_op(sem_id, SEM_STATS);
-
-        if (!running) {
-            break;
+    wait_for_start(stats);
+
+    /* The in-process engine has no atom table: it only takes batches */
+    int policy = config.engine_threads > 0 ? TARGET_ANY : config.activation_target;
+
+    /* Main loop - activate atoms every tick, on deadlines fixed from the
+     * start so the time spent activating does not stretch the period */
+    int carry = 0; /* activations owed by the rounding of previous ticks */
+    int periods = 1;
+    Schedule schedule;
+    schedule_start(&schedule, 1000000000L / ACTIVATION_TICKS_PER_SEC);
+
+    do {
+        /* Decide how many atoms to activate in this tick; the controller
+         * looks at the energy now, so late ticks are not added up */
+        int num_activations = 0;
+        if (config.activation_control == CONTROL_ENERGY) {
+            num_activations = policy == TARGET_ANY ? controller_activations(stats) : 0;
+        } else {
+            for (int i = 0; i < periods; i++) {
+                num_activations += activations_for_tick(&carry, &rng);
+            }
         }
 
-        /* Activate atoms if there are any */
-        if (num_atoms > 0) {
-            /* Decide how many atoms to activate (1-3) */
-            int num_activations = (rand() % 3) + 1;
-
-            for (int i = 0; i < num_activations; i++) {
-                /* Send split message to any atom (target_pid = 0) */
-                if (send_message(msg_id, MSG_SPLIT, 0, 0) == 0) {
-                    update_stats_activation(stats, sem_id);
-                }
+        if (config.activation_control == CONTROL_ENERGY && policy != TARGET_ANY) {
+            /* Targeted and controlled: the atoms are picked by their yield */
+            long needed, room;
+            controller_energy(stats, &needed, &room);
+            int delivered = needed > 0 ? activate_for_energy(needed, room) : 0;
+            if (delivered > 0) {
+                update_stats_activations(stats, delivered);
+            }
+        } else if (policy != TARGET_ANY) {
+            /* Targeted: straight into the chosen atoms' mailboxes */
+            int delivered = policy == TARGET_LARGEST || policy == TARGET_SMALLEST
+                                ? activate_by_size(policy == TARGET_SMALLEST, num_activations)
+                                : activate_targets(policy, num_activations);
+            if (delivered > 0) {
+                update_stats_activations(stats, delivered);
+            }
+        } else if (stats_atom_count(stats) > 0 && num_activations > 0) {
+            /* Activate atoms if there are any: the whole tick is one message
+             * to any atom (target_pid = 0) and one statistics update */
+            if (send_message(msg_id, MSG_SPLIT, 0, num_activations) == 0) {
+                update_stats_activations(stats, num_activations);
             }
         }
 
-        /* Sleep to avoid busy waiting */
-        nanosleep(&sleep_time, NULL);
-    }
+        /* Sleep until the next tick, waking up at once if the simulation stops */
+    } while ((periods = schedule_wait(stats, &schedule)) > 0);
 
     return 0;
 }
@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# Benchmark driver: runs ./master over a grid of configurations and collects
+# the JSON summary of every run into results.jsonl and results.csv.
+#
+# The grid is set with space-separated lists:
+#   BENCH_N_ATOMI_INIT, BENCH_N_NUOVI_ATOMI, BENCH_STEP, BENCH_ACTIVATION_RATE
+# BENCH_DURATION is the SIM_DURATION of each run and BENCH_OUT the output
+# directory. Any other variable (TRANSPORT, SPAWN_MODE, ...) is passed
+# through to every run.
+
+BENCH_N_ATOMI_INIT=${BENCH_N_ATOMI_INIT:-"10 100"}
+BENCH_N_NUOVI_ATOMI=${BENCH_N_NUOVI_ATOMI:-"2 10"}
+BENCH_STEP=${BENCH_STEP:-"1000000000 100000000"}
+BENCH_ACTIVATION_RATE=${BENCH_ACTIVATION_RATE:-"0 1000"}
+BENCH_DURATION=${BENCH_DURATION:-3}
+BENCH_OUT=${BENCH_OUT:-bench_results/$(date +%Y%m%d-%H%M%S)-$(git rev-parse --short HEAD 2>/dev/null || echo local)}
+
+mkdir -p "$BENCH_OUT" || exit 1
+JSONL="$BENCH_OUT/results.jsonl"
+CSV="$BENCH_OUT/results.csv"
+: > "$JSONL"
+
+# Benchmarks measure the machine, not the energy rules: never explode or
+# black out before the duration is reached
+export SIM_DURATION=$BENCH_DURATION
+export ENERGY_EXPLODE_THRESHOLD=${ENERGY_EXPLODE_THRESHOLD:-2000000000}
+export ENERGY_DEMAND=${ENERGY_DEMAND:-0}
+
+runs=0
+for n_init in $BENCH_N_ATOMI_INIT; do
+for n_new in $BENCH_N_NUOVI_ATOMI; do
+for step in $BENCH_STEP; do
+for rate in $BENCH_ACTIVATION_RATE; do
+    runs=$((runs + 1))
+    echo "Run $runs: N_ATOMI_INIT=$n_init N_NUOVI_ATOMI=$n_new STEP=$step ACTIVATION_RATE=$rate"
+
+    N_ATOMI_INIT=$n_init N_NUOVI_ATOMI=$n_new STEP=$step ACTIVATION_RATE=$rate \
+        SUMMARY_FILE="$JSONL" ./master > "$BENCH_OUT/run-$runs.log" 2>&1
+
+    tail -n 1 "$JSONL" | grep -o '"splits_per_sec":[0-9.]*\|"activation_p99_ns":[0-9]*' | tr '\n' ' '
+    echo
+done
+done
+done
+done
+
+# Every summary has the same keys in the same order: the keys of the first
+# line are the header, the values of each line a row
+head -n 1 "$JSONL" | sed 's/[{}"]//g' | tr ',' '\n' | cut -d: -f1 | paste -sd, - > "$CSV"
+while read -r line; do
+    echo "$line" | sed 's/[{}"]//g' | tr ',' '\n' | cut -d: -f2 | paste -sd, -
+done < "$JSONL" >> "$CSV"
+
+echo "Results: $CSV ($runs runs)"
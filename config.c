@@ -1,4 +1,5 @@
 #include "config.h"
+#include "shared.h"
 #include <string.h>
 
 Config config;
@@ -19,7 +20,28 @@ long get_env_long(const char* name, long default_val) {
     return atol(val);
 }
 
+int get_env_choice(const char* name, const char* const choices[], int default_val) {
+    char* val = getenv(name);
+    if (val == NULL) {
+        return default_val;
+    }
+    for (int i = 0; choices[i] != NULL; i++) {
+        if (strcmp(val, choices[i]) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "Unknown %s value '%s', using '%s'\n", name, val, choices[default_val]);
+    return default_val;
+}
+
 void load_config(void) {
+    static const char* const schedule_policies[] = { "catchup", "skip", NULL };
+    static const char* const controls[] = { "off", "energy", NULL };
+    static const char* const targets[] = { "any", "random", "largest", "oldest", "smallest", NULL };
+    static const char* const transports[] = { "msgqueue", "ring", NULL };
+    static const char* const spawn_modes[] = { "fork", "exec", NULL };
+    static const char* const time_modes[] = { "real", "virtual", NULL };
+
     config.n_atomi_init = get_env_int("N_ATOMI_INIT", 10);
     config.n_atom_max = get_env_int("N_ATOM_MAX", 100);
     config.min_n_atomico = get_env_int("MIN_N_ATOMICO", 5);
@@ -28,4 +50,55 @@ void load_config(void) {
     config.sim_duration = get_env_long("SIM_DURATION", 30);
     config.step = get_env_long("STEP", 1000000000); /* 1 second in nanoseconds */
     config.n_nuovi_atomi = get_env_int("N_NUOVI_ATOMI", 2);
+    config.activation_rate = get_env_int("ACTIVATION_RATE", 0);
+    config.activation_target = get_env_choice("ACTIVATION_TARGET", targets, TARGET_ANY);
+    config.activation_control = get_env_choice("ACTIVATION_CONTROL", controls, CONTROL_OFF);
+    config.energy_band_low = get_env_int("ENERGY_BAND_LOW", config.energy_explode_threshold / 4);
+    config.energy_band_high = get_env_int("ENERGY_BAND_HIGH", config.energy_explode_threshold / 2);
+    config.transport = get_env_choice("TRANSPORT", transports, TRANSPORT_MSGQUEUE);
+    config.schedule_policy = get_env_choice("SCHEDULE_POLICY", schedule_policies, SCHEDULE_CATCHUP);
+    config.tick_ms = get_env_int("TICK_MS", 10);
+    config.spawn_mode = get_env_choice("SPAWN_MODE", spawn_modes, SPAWN_FORK);
+    config.atom_pool_size = get_env_int("ATOM_POOL_SIZE", 0);
+    config.process_budget = get_env_int("PROCESS_BUDGET", 0);
+    config.engine_threads = get_env_int("ENGINE_THREADS", 0);
+    config.summary_file = getenv("SUMMARY_FILE");
+    config.telemetry = getenv("TELEMETRY");
+    config.telemetry_ms = get_env_int("TELEMETRY_MS", 1000);
+    config.seed = get_env_long("SEED", 0);
+    config.time_mode = get_env_choice("TIME_MODE", time_modes, TIME_REAL);
+
+    /* STEP is the period of the feeding loop: nothing sensible to fall back to */
+    if (config.step <= 0) {
+        fprintf(stderr, "STEP must be a positive number of nanoseconds, got %ld\n", config.step);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.tick_ms < 1 || config.tick_ms > 1000) {
+        config.tick_ms = 10;
+    }
+    if (config.telemetry_ms < 1) {
+        config.telemetry_ms = 1000;
+    }
+
+    /* The band has to leave room below the explosion */
+    if (config.energy_band_low < 0 || config.energy_band_high <= config.energy_band_low ||
+        config.energy_band_high >= config.energy_explode_threshold) {
+        config.energy_band_low = config.energy_explode_threshold / 4;
+        config.energy_band_high = config.energy_explode_threshold / 2;
+    }
+
+    /* Idle atoms wait on a ring of RING_SIZE assignments; the in-process
+     * engine and virtual time have no atom processes to pool */
+    if (config.atom_pool_size > RING_SIZE) {
+        config.atom_pool_size = RING_SIZE;
+    }
+    if (config.engine_threads > 0 || config.time_mode == TIME_VIRTUAL) {
+        config.atom_pool_size = 0;
+    }
+
+    /* Virtual time runs the engine's array from the master's thread */
+    if (config.time_mode == TIME_VIRTUAL) {
+        config.engine_threads = 0;
+    }
 }
@@ -4,6 +4,45 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+/* Values of ACTIVATION_TARGET */
+enum {
+    TARGET_ANY,                 /* Batches on the shared queue, taken by any atom */
+    TARGET_RANDOM,              /* Random atom of the atom table */
+    TARGET_LARGEST,             /* Largest atomic number (highest yield) first */
+    TARGET_OLDEST,              /* Oldest atom first */
+    TARGET_SMALLEST             /* Smallest atomic number that still splits first */
+};
+
+/* Values of ACTIVATION_CONTROL */
+enum {
+    CONTROL_OFF,                /* ACTIVATION_RATE, whatever the energy */
+    CONTROL_ENERGY              /* Hold the energy in [ENERGY_BAND_LOW, ENERGY_BAND_HIGH] */
+};
+
+/* Values of SCHEDULE_POLICY */
+enum {
+    SCHEDULE_CATCHUP,           /* Missed periods run at once on the next wake-up */
+    SCHEDULE_SKIP               /* Missed periods are dropped */
+};
+
+/* Values of TRANSPORT */
+enum {
+    TRANSPORT_MSGQUEUE,         /* System V message queue */
+    TRANSPORT_RING              /* Ring buffer in the shared memory segment */
+};
+
+/* Values of TIME_MODE */
+enum {
+    TIME_REAL,                  /* Processes running against the wall clock */
+    TIME_VIRTUAL                /* Event queue in the master, on a simulated clock */
+};
+
+/* Values of SPAWN_MODE */
+enum {
+    SPAWN_FORK,                 /* fork and run the linked-in atom body */
+    SPAWN_EXEC                  /* fork and exec ./atomo */
+};
+
 typedef struct {
     int n_atomi_init;           /* Initial number of atoms */
     int n_atom_max;             /* Maximum atomic number */
@@ -13,6 +52,23 @@ typedef struct {
     long sim_duration;          /* Simulation duration in seconds */
     long step;                  /* Nanoseconds between new atom additions */
     int n_nuovi_atomi;          /* Number of new atoms added each STEP */
+    int activation_rate;        /* Activations per second (0 = 1-3 every 100ms) */
+    int activation_target;      /* TARGET_* policy of attivatore */
+    int activation_control;     /* CONTROL_* deciding the activations of a tick */
+    int energy_band_low;        /* Energy band of CONTROL_ENERGY */
+    int energy_band_high;
+    int transport;              /* TRANSPORT_* used for Message */
+    int schedule_policy;        /* SCHEDULE_* of attivatore and alimentazione when late */
+    int tick_ms;                /* Master tick for energy and termination checks, in ms */
+    int spawn_mode;             /* SPAWN_* used by master and alimentazione */
+    int atom_pool_size;         /* Pre-forked idle atom processes (0 = none) */
+    int process_budget;         /* Most processes of the run (0 = only RLIMIT_NPROC and pids.max) */
+    int engine_threads;         /* Worker threads of the in-process engine (0 = one process per atom) */
+    const char* summary_file;   /* File the master appends a JSON summary of the run to (NULL = none) */
+    const char* telemetry;      /* File or unix:<path> socket the master streams records to (NULL = none) */
+    int telemetry_ms;           /* Interval between telemetry records, in ms */
+    long seed;                  /* Seed of every random draw (0 = the master picks one) */
+    int time_mode;              /* TIME_* clock the simulation runs on */
 } Config;
 
 extern Config config;
@@ -26,4 +82,8 @@ int get_env_int(const char* name, int default_val);
 /* Get long from environment or return default */
 long get_env_long(const char* name, long default_val);
 
+/* Get the index of the environment value in a NULL-terminated list of
+ * choices, or return default */
+int get_env_choice(const char* name, const char* const choices[], int default_val);
+
 #endif
@@ -0,0 +1,56 @@
+#include "controller.h"
+#include "config.h"
+
+void controller_energy(Statistics* stats, long* needed, long* room) {
+    StatsSnapshot snap;
+    stats_snapshot(stats, &snap);
+
+    long energy = stats_current_energy(&snap);
+    long setpoint = ((long)config.energy_band_low + config.energy_band_high) / 2;
+    long consumed = config.energy_demand / ACTIVATION_TICKS_PER_SEC;
+
+    *needed = (setpoint - energy) / 2 + consumed;
+    *room = config.energy_band_high - energy + consumed;
+    if (*needed < 0) {
+        *needed = 0;
+    }
+    if (*room < 0) {
+        *room = 0;
+    }
+}
+
+int controller_activations(Statistics* stats) {
+    long counts[POPULATION_BINS];
+    long needed, room;
+    long atoms = 0;
+    double yield = 0;
+    int width = stats->population_width > 0 ? stats->population_width : 1;
+
+    controller_energy(stats, &needed, &room);
+    if (needed == 0) {
+        return 0;
+    }
+
+    stats_population(stats, counts);
+    for (int b = 0; b < POPULATION_BINS; b++) {
+        if (counts[b] > 0) {
+            atoms += counts[b];
+            yield += (double)counts[b] * activation_yield(b * width + width / 2);
+        }
+    }
+    if (atoms == 0 || yield <= 0) {
+        return 0;
+    }
+    yield /= atoms;
+
+    /* Round down when rounding up would leave the band, and never ask for
+     * more activations than there are atoms: the rest would only queue */
+    long count = (long)(needed / yield + 0.5);
+    if (count * yield > room) {
+        count = (long)(room / yield);
+    }
+    if (count == 0 && yield <= room) {
+        count = 1;
+    }
+    return count > atoms ? (int)atoms : (int)count;
+}
@@ -0,0 +1,25 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include "shared.h"
+
+/*
+ * Closed-loop activation control (ACTIVATION_CONTROL=energy).
+ *
+ * Instead of a fixed ACTIVATION_RATE, every attivatore tick asks for the
+ * energy that brings the net energy halfway back to the middle of
+ * [ENERGY_BAND_LOW, ENERGY_BAND_HIGH], plus what the master consumes until
+ * the next tick. Halving the error keeps the loop stable although the
+ * splits of a tick land after it has been measured.
+ */
+
+/* Energy the activations of the next tick should release (0 = none), and
+ * the most they may release without leaving the band */
+void controller_energy(Statistics* stats, long* needed, long* room);
+
+/* Activations of the next tick for untargeted activation: the energy
+ * needed over the mean yield of an activation of a random live atom,
+ * estimated from the population by atomic number */
+int controller_activations(Statistics* stats);
+
+#endif
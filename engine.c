@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "engine.h"
+#include "config.h"
+#include "rng.h"
+
+static Statistics* stats;
+static int sem_id, msg_id;
+
+static pthread_t* workers = NULL;
+static int n_workers = 0;
+
+/* The atom array is split in one shard per worker. A worker only splits
+ * atoms of its own shard and the halves stay there, so the workers of a
+ * batch only meet on a shard lock when atoms are added or counted. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* signalled when activations are handed over */
+    int* atoms;                 /* atomic numbers, in no particular order */
+    size_t count;
+    size_t capacity;
+    int pending;                /* activations handed to the shard, not applied yet */
+    long sent_ns;               /* send time of the oldest pending activation */
+    size_t weight;              /* dispatch only: size snapshot and share of a batch */
+    long share;
+} __attribute__((aligned(CACHE_LINE))) Shard;
+
+static Shard* shards = NULL;
+static int n_shards = 0;
+static _Atomic unsigned int next_shard = 0; /* round robin of the new atoms */
+
+/* Append an atom to a shard; the caller holds its lock */
+static int push_atom(Shard* shard, int atomic_number) {
+    if (shard->count == shard->capacity) {
+        size_t capacity = shard->capacity > 0 ? shard->capacity * 2 : 1024;
+        int* grown = realloc(shard->atoms, capacity * sizeof(int));
+        if (grown == NULL) {
+            return -1;
+        }
+        shard->atoms = grown;
+        shard->capacity = capacity;
+    }
+    shard->atoms[shard->count++] = atomic_number;
+    stats_atom_born(stats, atomic_number);
+    return 0;
+}
+
+int engine_add_atom(int atomic_number) {
+    Shard* shard = &shards[atomic_fetch_add(&next_shard, 1) % n_shards];
+
+    pthread_mutex_lock(&shard->lock);
+    int result = push_atom(shard, atomic_number);
+    size_t count = shard->count;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (result == -1) {
+        fprintf(stderr, "engine: cannot grow atom shard to %zu atoms\n", count + 1);
+    }
+    return result;
+}
+
+/* Same rules as atomo.c::split_atom, applied to a random atom of the shard */
+static void split_random_atom(Shard* shard, Rng* rng) {
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->count == 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    size_t i = rng_range(rng, (uint32_t)shard->count);
+    int atomic_number = shard->atoms[i];
+
+    if (atomic_number <= config.min_n_atomico) {
+        /* Atom becomes waste: swap the last one into its place */
+        shard->atoms[i] = shard->atoms[--shard->count];
+        update_stats_waste(stats);
+        stats_atom_died(stats, atomic_number);
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    int n1 = atomic_number / 2;
+    int n2 = atomic_number - n1;
+
+    shard->atoms[i] = n1;
+    stats_atom_split(stats, atomic_number, n1);
+    if (push_atom(shard, n2) == -1) {
+        /* Out of memory - meltdown, like a failed fork */
+        pthread_mutex_unlock(&shard->lock);
+        fprintf(stderr, "engine: cannot grow atom shard\n");
+        stop_simulation(stats, TERM_MELTDOWN);
+        return;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    update_stats_split(stats);
+    update_stats_energy(stats, calculate_energy(n1, n2));
+}
+
+void engine_activate(int count, Rng* rng) {
+    for (int i = 0; i < count && is_running(stats); i++) {
+        split_random_atom(&shards[0], rng);
+    }
+}
+
+/* Hand count activations to the shards in proportion to their atoms, so
+ * every atom is as likely to be hit as in a single array */
+static void dispatch(int count, long sent_ns, Rng* rng) {
+    size_t total = 0;
+    long given = 0;
+
+    for (int j = 0; j < n_shards; j++) {
+        pthread_mutex_lock(&shards[j].lock);
+        shards[j].weight = shards[j].count;
+        pthread_mutex_unlock(&shards[j].lock);
+        total += shards[j].weight;
+    }
+    if (total == 0) {
+        return;
+    }
+
+    for (int j = 0; j < n_shards; j++) {
+        shards[j].share = (long)count * (long)shards[j].weight / (long)total;
+        given += shards[j].share;
+    }
+
+    /* The activations left by the rounding go to shards drawn by atom */
+    for (; given < count; given++) {
+        size_t draw = rng_range(rng, (uint32_t)total);
+        int j = 0;
+        while (draw >= shards[j].weight) {
+            draw -= shards[j].weight;
+            j++;
+        }
+        shards[j].share++;
+    }
+
+    for (int j = 0; j < n_shards; j++) {
+        Shard* shard = &shards[j];
+        if (shard->share == 0) {
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        if (shard->pending == 0) {
+            shard->sent_ns = sent_ns;
+        }
+        shard->pending += shard->share;
+        pthread_cond_signal(&shard->wake);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Apply the activations handed to the shard. With wait set, sleep until
+ * there are some; returns 0 once the simulation stopped. */
+static int drain_shard(Shard* shard, Rng* rng, int wait) {
+    pthread_mutex_lock(&shard->lock);
+    while (wait && shard->pending == 0 && is_running(stats)) {
+        pthread_cond_wait(&shard->wake, &shard->lock);
+    }
+    int count = shard->pending;
+    long sent_ns = shard->sent_ns;
+    shard->pending = 0;
+    pthread_mutex_unlock(&shard->lock);
+
+    for (int i = 0; i < count && is_running(stats); i++) {
+        split_random_atom(shard, rng);
+        record_activation_latency(stats, sent_ns);
+    }
+    return is_running(stats);
+}
+
+static void* worker_main(void* arg) {
+    long id = (long)arg;
+    Shard* shard = &shards[id];
+    Rng rng;
+    rng_seed(&rng, config.seed, RNG_STREAM_ENGINE + id);
+
+    wait_for_start(stats);
+
+    /* Every worker but the first only serves its shard */
+    if (id > 0) {
+        while (drain_shard(shard, &rng, 1)) {
+        }
+        return NULL;
+    }
+
+    /* The first worker takes the messages, spreads each batch over all
+     * the shards and then serves its own */
+    while (is_running(stats)) {
+        Message msg;
+
+        /* Lowest type first: splits before new atoms and MSG_TERMINATE */
+        if (receive_message(msg_id, &msg, -MSG_NEW_ATOM) == -1) {
+            if (errno == EIDRM || errno == EINVAL) {
+                break;
+            }
+            continue;
+        }
+
+        switch (msg.mtype) {
+            case MSG_SPLIT:
+                dispatch(MSG_ACTIVATIONS(&msg), msg.sent_ns, &rng);
+                drain_shard(shard, &rng, 0);
+                break;
+            case MSG_NEW_ATOM:
+                if (engine_add_atom(msg.value) == -1) {
+                    stop_simulation(stats, TERM_MELTDOWN);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+int engine_start(Statistics* shared_stats, int shared_sem_id, int shared_msg_id, int workers_wanted) {
+    stats = shared_stats;
+    sem_id = shared_sem_id;
+    msg_id = shared_msg_id;
+
+    /* Virtual time: one shard, driven by the master itself */
+    int shards_wanted = workers_wanted > 0 ? workers_wanted : 1;
+    if (posix_memalign((void**)&shards, CACHE_LINE, shards_wanted * sizeof(Shard)) != 0) {
+        shards = NULL;
+        perror("posix_memalign shards");
+        return -1;
+    }
+    memset(shards, 0, shards_wanted * sizeof(Shard));
+    for (n_shards = 0; n_shards < shards_wanted; n_shards++) {
+        pthread_mutex_init(&shards[n_shards].lock, NULL);
+        pthread_cond_init(&shards[n_shards].wake, NULL);
+    }
+
+    if (workers_wanted == 0) {
+        return 0;
+    }
+
+    workers = calloc(workers_wanted, sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("calloc workers");
+        return -1;
+    }
+
+    for (n_workers = 0; n_workers < workers_wanted; n_workers++) {
+        int err = pthread_create(&workers[n_workers], NULL, worker_main, (void*)(long)n_workers);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            engine_stop();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void engine_stop(void) {
+    if (workers != NULL) {
+        stop_simulation(stats, TERM_NONE);
+
+        /* Wake the workers sleeping on their shard, and the first one if it
+         * is blocked in msgrcv; they see the run stopped and exit. If the
+         * queue is full nobody is blocked, so a failed send is fine. */
+        for (int i = 0; i < n_shards; i++) {
+            pthread_mutex_lock(&shards[i].lock);
+            pthread_cond_broadcast(&shards[i].wake);
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+        try_send_message(msg_id, MSG_TERMINATE, 0, 0);
+        for (int i = 0; i < n_workers; i++) {
+            pthread_join(workers[i], NULL);
+        }
+
+        free(workers);
+        workers = NULL;
+        n_workers = 0;
+    }
+
+    for (int i = 0; i < n_shards; i++) {
+        free(shards[i].atoms);
+        pthread_mutex_destroy(&shards[i].lock);
+        pthread_cond_destroy(&shards[i].wake);
+    }
+    free(shards);
+    shards = NULL;
+    n_shards = 0;
+}
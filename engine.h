@@ -0,0 +1,32 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "shared.h"
+#include "rng.h"
+
+/*
+ * In-process engine (ENGINE_THREADS > 0).
+ *
+ * Atoms are entries in a compact array owned by the master instead of
+ * processes, split in one shard per worker thread. The first worker
+ * receives the same MSG_SPLIT messages the atom processes would and
+ * spreads each batch over the shards; every worker applies its share to
+ * random atoms of its own shard. alimentazione injects atoms with
+ * MSG_NEW_ATOM instead of forking.
+ * Statistics are updated through the same functions as the atom processes.
+ */
+
+/* Start the worker pool. With no workers the array is driven by the
+ * caller (virtual time). Returns 0 on success, -1 on failure. */
+int engine_start(Statistics* stats, int sem_id, int msg_id, int n_workers);
+
+/* Add an atom to the array. Returns 0 on success, -1 on failure (MELTDOWN). */
+int engine_add_atom(int atomic_number);
+
+/* Apply count activations to random atoms from the calling thread */
+void engine_activate(int count, Rng* rng);
+
+/* Wake and join the workers, then free the array. Safe to call twice. */
+void engine_stop(void);
+
+#endif
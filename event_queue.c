@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include "event_queue.h"
+
+static int earlier(const Event* a, const Event* b) {
+    return a->time < b->time || (a->time == b->time && a->type < b->type);
+}
+
+int event_push(EventQueue* queue, long time, int type) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity > 0 ? queue->capacity * 2 : 16;
+        Event* grown = realloc(queue->events, capacity * sizeof(Event));
+        if (grown == NULL) {
+            return -1;
+        }
+        queue->events = grown;
+        queue->capacity = capacity;
+    }
+
+    /* Sift up from the new leaf */
+    size_t i = queue->count++;
+    Event event = { time, type };
+    while (i > 0 && earlier(&event, &queue->events[(i - 1) / 2])) {
+        queue->events[i] = queue->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->events[i] = event;
+    return 0;
+}
+
+int event_pop(EventQueue* queue, Event* event) {
+    if (queue->count == 0) {
+        return 0;
+    }
+    *event = queue->events[0];
+
+    /* Sift the last leaf down from the root */
+    Event last = queue->events[--queue->count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= queue->count) {
+            break;
+        }
+        if (child + 1 < queue->count && earlier(&queue->events[child + 1], &queue->events[child])) {
+            child++;
+        }
+        if (!earlier(&queue->events[child], &last)) {
+            break;
+        }
+        queue->events[i] = queue->events[child];
+        i = child;
+    }
+    queue->events[i] = last;
+    return 1;
+}
+
+void event_queue_free(EventQueue* queue) {
+    free(queue->events);
+    queue->events = NULL;
+    queue->count = 0;
+    queue->capacity = 0;
+}
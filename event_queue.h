@@ -0,0 +1,31 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stddef.h>
+
+/*
+ * Event queue of the virtual-time mode (TIME_MODE=virtual): a binary
+ * min-heap of events ordered by time, then by type, so that events due at
+ * the same instant always run in the same order.
+ */
+
+typedef struct {
+    long time;                  /* Virtual ns since the start of the run */
+    int type;
+} Event;
+
+typedef struct {
+    Event* events;
+    size_t count;
+    size_t capacity;
+} EventQueue;
+
+/* Schedule an event. Returns 0 on success, -1 if out of memory. */
+int event_push(EventQueue* queue, long time, int type);
+
+/* Take the earliest event. Returns 0 if the queue is empty. */
+int event_pop(EventQueue* queue, Event* event);
+
+void event_queue_free(EventQueue* queue);
+
+#endif
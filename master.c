@@ -5,38 +5,146 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
 #include "shared.h"
 #include "config.h"
+#include "atomo_core.h"
+#include "admission.h"
+#include "engine.h"
+#include "telemetry.h"
+#include "event_queue.h"
+#include "rng.h"
+#include "controller.h"
 
 static int shm_id = -1, sem_id = -1, msg_id = -1;
 static Statistics* stats = NULL;
-static time_t start_time;
+static long start_ns;
+static long virtual_ns = -1; /* Clock of TIME_MODE=virtual, -1 in real time */
+static long peak_atoms;
+static Rng rng;
+
+/* Energy an atom of each population bin releases until it is waste */
+static long bin_potential[POPULATION_BINS];
+
+/* Rows of the population histogram in the statistics */
+#define POPULATION_ROWS 10
+#define POPULATION_BAR 40
+
+/* Grace period for each shutdown phase before escalating */
+#define SHUTDOWN_GRACE_NS 500000000L
+
+static pid_t attivatore_pid = -1, alimentazione_pid = -1;
+static int own_group = 0; /* the master leads the process group of the run */
+
+/* Reap descendants until none is left or the deadline passes. As child
+ * subreaper the master inherits the atoms orphaned by their parents, so no
+ * children left means no descendants left. Returns 1 when all are gone. */
+static int reap_children(long deadline_ns, int* reaped) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+
+    for (;;) {
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (stats != NULL) {
+                stats_child_exited(stats, status);
+            }
+            (*reaped)++;
+        }
+        if (pid == -1 && errno == ECHILD) {
+            return 1;
+        }
 
-/* Cleanup IPC resources */
-void cleanup_ipc(void) {
-    /* Send termination signal to all processes */
-    if (stats != NULL) {
-        sem_wait_op(sem_id, SEM_STATS);
-        stats->running = 0;
-        sem_signal_op(sem_id, SEM_STATS);
+        long remaining = deadline_ns - monotonic_ns();
+        if (remaining <= 0) {
+            return 0;
+        }
 
-        detach_shared_memory(stats);
+        /* SIGCHLD is blocked, so it stays pending until we get here */
+        struct timespec timeout = {
+            .tv_sec = remaining / 1000000000L,
+            .tv_nsec = remaining % 1000000000L,
+        };
+        sigtimedwait(&set, NULL, &timeout);
     }
+}
 
-    /* Wait a bit for children to terminate */
-    sleep(1);
+/* Signal the registered atoms and the helper processes */
+static void signal_children(int signum) {
+    int used = atom_table_used(stats);
+    for (int i = 0; i < used; i++) {
+        pid_t pid = atomic_load(&stats->atoms[i].pid);
+        if (pid > 0) {
+            kill(pid, signum);
+        }
+    }
+    if (attivatore_pid > 0) {
+        kill(attivatore_pid, signum);
+    }
+    if (alimentazione_pid > 0) {
+        kill(alimentazione_pid, signum);
+    }
+}
 
-    /* Kill any remaining children */
-    signal(SIGTERM, SIG_IGN);
-    kill(0, SIGTERM);
+/* Cleanup IPC resources */
+void cleanup_ipc(void) {
+    int reaped = 0;
+    int signalled = 0;
+    long shutdown_ns = monotonic_ns();
 
-    /* Wait for all children */
-    while (wait(NULL) > 0);
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
 
-    /* Destroy IPC resources */
+    if (stats != NULL) {
+        /* Wake every futex sleeper: atoms on their mailbox, the ring or the
+         * pool, attivatore and alimentazione between ticks */
+        stop_simulation(stats, TERM_NONE);
+        engine_stop();
+    }
+
+    /* Removing the queue fails every pending msgrcv/msgsnd with EIDRM */
     if (msg_id != -1) {
         destroy_message_queue(msg_id);
+        msg_id = -1;
+    }
+
+    /* Escalate only for processes that did not notice the broadcast */
+    if (!reap_children(monotonic_ns() + SHUTDOWN_GRACE_NS, &reaped) && stats != NULL) {
+        signalled = 1;
+        signal_children(SIGTERM);
+        /* Idle pool atoms, children between fork and claim and atoms that
+         * found the table full are not registered: reach them through the
+         * process group of the run, which only the master's own descendants
+         * are in */
+        if (own_group) {
+            signal(SIGTERM, SIG_IGN);
+            kill(-getpgrp(), SIGTERM);
+        }
+        if (!reap_children(monotonic_ns() + SHUTDOWN_GRACE_NS, &reaped)) {
+            signal_children(SIGKILL);
+            reap_children(monotonic_ns() + SHUTDOWN_GRACE_NS, &reaped);
+        }
     }
+
+    if (stats != NULL) {
+        printf("Shutdown: %d processes reaped in %.1f ms%s\n",
+               reaped, (monotonic_ns() - shutdown_ns) / 1e6,
+               signalled ? " (stragglers signalled)" : "");
+        detach_shared_memory(stats);
+        stats = NULL;
+    }
+
+    /* Destroy IPC resources */
     if (sem_id != -1) {
         destroy_semaphores(sem_id);
     }
@@ -48,18 +156,33 @@ void cleanup_ipc(void) {
 void signal_handler(int signum) {
     (void)signum; /* Suppress unused parameter warning */
     if (stats != NULL) {
-        sem_wait_op(sem_id, SEM_STATS);
-        stats->running = 0;
-        sem_signal_op(sem_id, SEM_STATS);
+        stop_simulation(stats, TERM_NONE);
     }
 }
 
-/* Create a new atom process */
-int create_atom(int atomic_number) {
+/* Start an atom process (atomic number 0 joins the pool): a plain fork
+ * running the linked-in atom body, or fork and exec of ./atomo. Returns 0
+ * when started, 1 when admission control defers it, -1 if fork failed. */
+int spawn_atom(int atomic_number) {
+    if (admission_reserve(stats, ADMIT_INJECT) == -1) {
+        return 1;
+    }
+
+    if (config.spawn_mode == SPAWN_FORK) {
+        if (fork_atom(stats, sem_id, msg_id, atomic_number) == -1) {
+            perror("fork failed in master");
+            admission_release(stats);
+            return -1;
+        }
+        return 0;
+    }
+
+    long start = monotonic_ns();
     pid_t pid = fork();
 
     if (pid == -1) {
         perror("fork failed in master");
+        admission_release(stats);
         return -1;
     } else if (pid == 0) {
         /* Child process - exec atomo */
@@ -75,94 +198,559 @@ int create_atom(int atomic_number) {
     }
 
     /* Parent */
+    stats_record(stats, OP_FORK, monotonic_ns() - start);
     return 0;
 }
 
+/* Create a new atom: hand it to an idle atom of the pool if there is one,
+ * otherwise spawn a process (or hand it to the in-process engine).
+ * Returns like spawn_atom. */
+int create_atom(int atomic_number) {
+    if (config.engine_threads > 0 || config.time_mode == TIME_VIRTUAL) {
+        return engine_add_atom(atomic_number);
+    }
+
+    if (config.atom_pool_size > 0 && pool_assign(stats, atomic_number) == 0) {
+        return 0;
+    }
+
+    return spawn_atom(atomic_number);
+}
+
+/* Time since the start of the run, on the clock of TIME_MODE */
+static long elapsed_ns(void) {
+    return virtual_ns >= 0 ? virtual_ns : monotonic_ns() - start_ns;
+}
+
+/* Bins wider than one atomic number use the potential of their middle */
+static void init_bin_potential(void) {
+    int width = stats->population_width;
+    for (int b = 0; b < POPULATION_BINS; b++) {
+        long mid = (long)b * width + width / 2;
+        if (mid > config.n_atom_max) {
+            mid = config.n_atom_max;
+        }
+        bin_potential[b] = split_potential(mid, config.min_n_atomico);
+    }
+}
+
+/* Live atoms by atomic number in POPULATION_ROWS ranges of 1..N_ATOM_MAX.
+ * Returns the energy the population still holds. */
+static long print_population(void) {
+    long counts[POPULATION_BINS];
+    long rows[POPULATION_ROWS] = {0};
+    long potential = 0;
+    int width = stats->population_width;
+
+    stats_population(stats, counts);
+
+    int bins = config.n_atom_max / width + 1;
+    if (bins > POPULATION_BINS) {
+        bins = POPULATION_BINS;
+    }
+    int per_row = (bins + POPULATION_ROWS - 1) / POPULATION_ROWS;
+    long most = 0;
+    for (int b = 0; b < POPULATION_BINS; b++) {
+        if (counts[b] <= 0) {
+            continue;
+        }
+        potential += counts[b] * bin_potential[b];
+        int row = b < bins ? b / per_row : POPULATION_ROWS - 1;
+        rows[row] += counts[b];
+        if (rows[row] > most) {
+            most = rows[row];
+        }
+    }
+
+    printf("Population by atomic number:\n");
+    for (int r = 0; r < POPULATION_ROWS && r * per_row < bins; r++) {
+        long lo = (long)r * per_row * width;
+        long hi = (long)(r + 1) * per_row * width - 1;
+        if (hi > config.n_atom_max || r == POPULATION_ROWS - 1) {
+            hi = config.n_atom_max;
+        }
+        int bar = most > 0 ? (int)(rows[r] * POPULATION_BAR / most) : 0;
+        printf("  %6ld-%-6ld %8ld %.*s\n", lo, hi, rows[r], bar,
+               "########################################");
+    }
+    return potential;
+}
+
 /* Print statistics */
 void print_stats(void) {
-    sem_wait_op(sem_id, SEM_STATS);
+    static StatsSnapshot last;
+    StatsSnapshot now;
+
+    /* Sum the counter slots; the last second is the difference from the
+     * previous snapshot, so nothing has to be reset under a lock */
+    stats_snapshot(stats, &now);
+
+    /* The ring tracks its peak on every send, the queue only here */
+    long depth = message_queue_depth(msg_id);
+    long peak = atomic_load(&stats->queue_peak);
+    if (depth > peak) {
+        atomic_store(&stats->queue_peak, depth);
+    }
 
-    time_t elapsed = time(NULL) - start_time;
+    long elapsed = elapsed_ns() / 1000000000L;
 
     printf("\n=== Simulation Statistics (Elapsed: %ld s) ===\n", elapsed);
     printf("Activations: %ld (last sec: %ld)\n",
-           stats->total_activations, stats->last_sec_activations);
+           now.activations, now.activations - last.activations);
     printf("Splits:      %ld (last sec: %ld)\n",
-           stats->total_splits, stats->last_sec_splits);
+           now.splits, now.splits - last.splits);
     printf("Energy produced: %ld (last sec: %ld)\n",
-           stats->total_energy_produced, stats->last_sec_energy_produced);
+           now.energy_produced, now.energy_produced - last.energy_produced);
     printf("Energy consumed: %ld (last sec: %ld)\n",
-           stats->total_energy_consumed, stats->last_sec_energy_consumed);
-    printf("Current energy:  %ld\n", stats->current_energy);
+           now.energy_consumed, now.energy_consumed - last.energy_consumed);
+    printf("Current energy:  %ld\n", stats_current_energy(&now));
     printf("Waste:       %ld (last sec: %ld)\n",
-           stats->total_waste, stats->last_sec_waste);
-    printf("Active atoms: %d\n", stats->num_atoms);
-    printf("==========================================\n");
+           now.waste, now.waste - last.waste);
+    printf("Active atoms: %ld\n", now.atoms);
+    printf("Reaped:      %ld (last sec: %ld, failed: %ld, killed: %ld)\n",
+           now.reaped, now.reaped - last.reaped, now.exit_failures, now.killed);
+    if (stats->admission.budget != LONG_MAX) {
+        printf("Processes:   %ld of %ld (deferred atoms: %ld, backlog: %ld, refused splits: %ld)\n",
+               atomic_load(&stats->admission.processes), stats->admission.budget,
+               now.deferred_atoms, atomic_load(&stats->admission.backlog), now.refused_splits);
+    }
 
-    /* Reset last second counters */
-    stats->last_sec_activations = 0;
-    stats->last_sec_splits = 0;
-    stats->last_sec_energy_produced = 0;
-    stats->last_sec_energy_consumed = 0;
-    stats->last_sec_waste = 0;
+    /* Registered atoms by state; entries are claimed and freed without
+     * locks, so a count can be one transition behind */
+    long waiting = 0, splitting = 0;
+    int used = atom_table_used(stats);
+    for (int i = 0; i < used; i++) {
+        int state = atomic_load_explicit(&stats->atoms[i].state, memory_order_relaxed);
+        waiting += state == ATOM_WAITING;
+        splitting += state == ATOM_SPLITTING;
+    }
+    printf("Atom table:  %ld registered (waiting: %ld, splitting: %ld), %d of %d entries used\n",
+           waiting + splitting, waiting, splitting, used, ATOM_TABLE_SIZE);
+
+    /* If every live atom split down to waste, without further activation
+     * limits or consumption, the energy would reach current + potential */
+    long potential = print_population();
+    long projected = stats_current_energy(&now) + potential;
+    printf("Energy potential: %ld (projected energy: %ld of %d to explode%s)\n",
+           potential, projected, config.energy_explode_threshold,
+           projected >= config.energy_explode_threshold ? ", EXPLODE reachable" : "");
+    printf("Queue depth: %ld (peak: %ld, send failures: %ld)\n",
+           depth, atomic_load(&stats->queue_peak), atomic_load(&stats->send_failures));
+
+    /* Cumulative since the start of the run */
+    printf("Latency (us)      count      p50      p99      max\n");
+    for (int op = 0; op < NUM_OPS; op++) {
+        Histogram h;
+        stats_latency(stats, op, &h);
+        printf("  %-10s %10ld %8.1f %8.1f %8.1f\n", stats_op_names[op], h.count,
+               hist_percentile(&h, 50) / 1e3, hist_percentile(&h, 99) / 1e3, h.max / 1e3);
+    }
+    printf("==========================================\n");
 
-    sem_signal_op(sem_id, SEM_STATS);
+    last = now;
 }
 
 /* Check termination conditions */
 int check_termination(void) {
-    sem_wait_op(sem_id, SEM_STATS);
+    StatsSnapshot snap;
+    stats_snapshot(stats, &snap);
 
-    int should_terminate = 0;
+    /* Check explode */
+    long net_energy = stats_current_energy(&snap);
+    if (net_energy >= config.energy_explode_threshold) {
+        stop_simulation(stats, TERM_EXPLODE);
+    }
 
     /* Check timeout */
-    time_t elapsed = time(NULL) - start_time;
-    if (elapsed >= config.sim_duration) {
-        stats->termination_cause = TERM_TIMEOUT;
-        should_terminate = 1;
+    if (elapsed_ns() >= config.sim_duration * 1000000000L) {
+        stop_simulation(stats, TERM_TIMEOUT);
     }
 
-    /* Check explode */
-    long net_energy = stats->total_energy_produced - stats->total_energy_consumed;
-    if (net_energy >= config.energy_explode_threshold) {
-        stats->termination_cause = TERM_EXPLODE;
-        should_terminate = 1;
+    /* Sampled every tick for the summary */
+    if (snap.atoms > peak_atoms) {
+        peak_atoms = snap.atoms;
     }
 
-    /* Check if already terminated by another process */
-    if (stats->termination_cause != TERM_NONE) {
-        should_terminate = 1;
+    /* Terminated here or already by another process */
+    return !is_running(stats);
+}
+
+/* Consume energy for the given number of ticks: ENERGY_DEMAND per second,
+ * pro-rated, with the rounding carried over so that a second of ticks
+ * consumes exactly ENERGY_DEMAND. BLACKOUT is only checked when a full
+ * second has been consumed, as with one withdrawal per second: a run that
+ * has produced nothing yet in its first ticks is not a blackout. */
+void consume_energy(uint64_t ticks) {
+    static long carry = 0;      /* in energy * ms */
+    static long elapsed_ms = 0; /* consumed time within the current second */
+    StatsSnapshot snap;
+
+    long amount = carry + (long)ticks * config.energy_demand * config.tick_ms;
+    carry = amount % 1000;
+
+    update_stats_consumed(stats, amount / 1000);
+
+    elapsed_ms += (long)ticks * config.tick_ms;
+    if (elapsed_ms < 1000) {
+        return;
     }
+    elapsed_ms %= 1000;
 
-    if (should_terminate) {
-        stats->running = 0;
+    /* Check blackout */
+    stats_snapshot(stats, &snap);
+    if (stats_current_energy(&snap) < 0) {
+        stop_simulation(stats, TERM_BLACKOUT);
     }
+}
 
-    sem_signal_op(sem_id, SEM_STATS);
-    return should_terminate;
+/* Fields of a histogram in the summary, prefixed by name */
+static void write_histogram(FILE* f, const char* name, Histogram* h) {
+    fprintf(f, ",\"%s_count\":%ld,\"%s_total_ns\":%ld", name, atomic_load(&h->count),
+            name, atomic_load(&h->sum));
+    fprintf(f, ",\"%s_p50_ns\":%ld,\"%s_p90_ns\":%ld,\"%s_p99_ns\":%ld,\"%s_max_ns\":%ld",
+            name, hist_percentile(h, 50), name, hist_percentile(h, 90),
+            name, hist_percentile(h, 99), name, atomic_load(&h->max));
 }
 
-/* Consume energy */
-void consume_energy(void) {
-    sem_wait_op(sem_id, SEM_STATS);
+/* Append a one-line JSON summary of the run to SUMMARY_FILE, for the
+ * benchmark driver */
+void write_summary(void) {
+    static const char* const causes[] = { "NONE", "TIMEOUT", "EXPLODE", "BLACKOUT", "MELTDOWN" };
+    StatsSnapshot snap;
 
-    stats->total_energy_consumed += config.energy_demand;
-    stats->last_sec_energy_consumed += config.energy_demand;
-    stats->current_energy -= config.energy_demand;
+    if (config.summary_file == NULL) {
+        return;
+    }
 
-    /* Check blackout */
-    if (stats->current_energy < 0) {
-        stats->termination_cause = TERM_BLACKOUT;
-        stats->running = 0;
+    FILE* f = fopen(config.summary_file, "a");
+    if (f == NULL) {
+        perror("fopen SUMMARY_FILE");
+        return;
+    }
+
+    stats_snapshot(stats, &snap);
+    double elapsed = elapsed_ns() / 1e9;
+
+    fprintf(f, "{\"cause\":\"%s\",\"elapsed_s\":%.3f", causes[atomic_load(&stats->termination_cause)], elapsed);
+    fprintf(f, ",\"seed\":%ld", config.seed);
+    fprintf(f, ",\"n_atomi_init\":%d,\"n_nuovi_atomi\":%d,\"step\":%ld,\"activation_rate\":%d",
+            config.n_atomi_init, config.n_nuovi_atomi, config.step, config.activation_rate);
+    fprintf(f, ",\"activations\":%ld,\"splits\":%ld,\"splits_per_sec\":%.1f,\"waste\":%ld",
+            snap.activations, snap.splits, elapsed > 0 ? snap.splits / elapsed : 0.0, snap.waste);
+    fprintf(f, ",\"energy_produced\":%ld,\"energy_consumed\":%ld,\"energy\":%ld",
+            snap.energy_produced, snap.energy_consumed, stats_current_energy(&snap));
+    fprintf(f, ",\"atoms\":%ld,\"peak_atoms\":%ld,\"queue_peak\":%ld,\"send_failures\":%ld",
+            snap.atoms, peak_atoms, atomic_load(&stats->queue_peak),
+            atomic_load(&stats->send_failures));
+    fprintf(f, ",\"reaped\":%ld,\"exit_failures\":%ld,\"killed\":%ld",
+            snap.reaped, snap.exit_failures, snap.killed);
+    fprintf(f, ",\"deferred_atoms\":%ld,\"refused_splits\":%ld",
+            snap.deferred_atoms, snap.refused_splits);
+    for (int op = 0; op < NUM_OPS; op++) {
+        Histogram h;
+        stats_latency(stats, op, &h);
+        write_histogram(f, stats_op_names[op], &h);
+    }
+    fprintf(f, "}\n");
+
+    fclose(f);
+}
+
+/* Create a non-blocking signalfd for the blocked SIGCHLD and add it to
+ * the epoll set */
+int add_sigchld(int epoll_fd) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+
+    int fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        perror("signalfd");
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Create a periodic CLOCK_MONOTONIC timerfd and add it to the epoll set */
+int add_timer(int epoll_fd, long period_ns) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = period_ns / 1000000000L;
+    spec.it_interval.tv_nsec = period_ns % 1000000000L;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Fork and exec attivatore and alimentazione */
+static void start_helpers(void) {
+    /* Create attivatore process */
+    printf("Creating attivatore process...\n");
+    admission_reserve(stats, ADMIT_HELPER);
+    attivatore_pid = fork();
+    if (attivatore_pid == -1) {
+        perror("fork attivatore failed");
+        exit(EXIT_FAILURE);
+    } else if (attivatore_pid == 0) {
+        char shm_str[32], sem_str[32], msg_str[32];
+        snprintf(shm_str, sizeof(shm_str), "%d", shm_id);
+        snprintf(sem_str, sizeof(sem_str), "%d", sem_id);
+        snprintf(msg_str, sizeof(msg_str), "%d", msg_id);
+
+        execl("./attivatore", "attivatore", shm_str, sem_str, msg_str, (char*)NULL);
+        perror("execl attivatore failed");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Create alimentazione process */
+    printf("Creating alimentazione process...\n");
+    admission_reserve(stats, ADMIT_HELPER);
+    alimentazione_pid = fork();
+    if (alimentazione_pid == -1) {
+        perror("fork alimentazione failed");
+        exit(EXIT_FAILURE);
+    } else if (alimentazione_pid == 0) {
+        char shm_str[32], sem_str[32], msg_str[32];
+        snprintf(shm_str, sizeof(shm_str), "%d", shm_id);
+        snprintf(sem_str, sizeof(sem_str), "%d", sem_id);
+        snprintf(msg_str, sizeof(msg_str), "%d", msg_id);
+
+        execl("./alimentazione", "alimentazione", shm_str, sem_str, msg_str, (char*)NULL);
+        perror("execl alimentazione failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Real time: timerfds for the tick, the report and the telemetry, while
+ * the other processes run the simulation */
+static void run_realtime(void) {
+    /* Timers: termination checks and energy every tick, report every second */
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    int tick_fd = add_timer(epoll_fd, config.tick_ms * 1000000L);
+    int report_fd = add_timer(epoll_fd, 1000000000L);
+    if (tick_fd == -1 || report_fd == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Telemetry records on their own timer */
+    int telemetry_fd = -1;
+    if (config.telemetry != NULL) {
+        telemetry_fd = add_timer(epoll_fd, config.telemetry_ms * 1000000L);
+        if (telemetry_fd == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Exited children: the initial atoms and the orphans adopted as
+     * subreaper, reaped as they go instead of at shutdown */
+    int child_fd = add_sigchld(epoll_fd);
+    if (child_fd == -1) {
+        exit(EXIT_FAILURE);
     }
+    reap_exited_children(stats);
+
+    /* Start simulation */
+    start_ns = monotonic_ns();
+    start_simulation(stats);
 
-    sem_signal_op(sem_id, SEM_STATS);
+    /* Main loop */
+    int done = 0;
+    while (!done) {
+        struct epoll_event events[4];
+        int n = epoll_wait(epoll_fd, events, 4, -1);
+
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                stop_simulation(stats, TERM_NONE);
+            }
+            /* Interrupted by a signal: it may have stopped the run */
+            done = check_termination();
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == child_fd) {
+                /* Signals of the same kind merge: drain, then reap all */
+                struct signalfd_siginfo info;
+                while (read(child_fd, &info, sizeof(info)) == sizeof(info)) {
+                }
+                reap_exited_children(stats);
+                continue;
+            }
+
+            uint64_t expirations;
+            if (read(events[i].data.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                continue;
+            }
+
+            if (events[i].data.fd == tick_fd) {
+                /* Consume energy and check termination conditions */
+                consume_energy(expirations);
+                done = check_termination();
+            } else if (events[i].data.fd == telemetry_fd) {
+                telemetry_write(stats, msg_id, elapsed_ns());
+            } else {
+                /* Print statistics */
+                print_stats();
+            }
+        }
+    }
+
+    close(tick_fd);
+    close(report_fd);
+    close(child_fd);
+    if (telemetry_fd != -1) {
+        close(telemetry_fd);
+    }
+    close(epoll_fd);
+}
+
+/* Events of the virtual-time mode, in the order they run when due at the
+ * same instant */
+enum {
+    EV_TICK,                    /* Master tick: energy and termination */
+    EV_FEED,                    /* alimentazione step */
+    EV_ACTIVATE,                /* attivatore tick */
+    EV_TELEMETRY,
+    EV_REPORT
+};
+
+/* Virtual time: the master plays attivatore and alimentazione on the
+ * engine's atom array, jumping from one event to the next instead of
+ * sleeping. Every role keeps its own random stream, so a seed gives the
+ * same run every time. */
+static void run_virtual(void) {
+    EventQueue queue = { NULL, 0, 0 };
+    Rng activation_rng, feed_rng, engine_rng;
+    long activation_period = 1000000000L / ACTIVATION_TICKS_PER_SEC;
+    long tick_period = config.tick_ms * 1000000L;
+    int carry = 0;
+    Event event;
+
+    rng_seed(&activation_rng, config.seed, RNG_STREAM_ATTIVATORE);
+    rng_seed(&feed_rng, config.seed, RNG_STREAM_ALIMENTAZIONE);
+    rng_seed(&engine_rng, config.seed, RNG_STREAM_ENGINE);
+
+    /* Same phases as the processes: attivatore acts at once, alimentazione
+     * and the timers after their first period */
+    int scheduled = event_push(&queue, 0, EV_ACTIVATE) |
+                    event_push(&queue, config.step, EV_FEED) |
+                    event_push(&queue, tick_period, EV_TICK) |
+                    event_push(&queue, 1000000000L, EV_REPORT);
+    if (config.telemetry != NULL) {
+        scheduled |= event_push(&queue, config.telemetry_ms * 1000000L, EV_TELEMETRY);
+    }
+    if (scheduled == -1) {
+        fprintf(stderr, "Failed to schedule the first events\n");
+        exit(EXIT_FAILURE);
+    }
+
+    virtual_ns = 0;
+    start_simulation(stats);
+
+    while (is_running(stats) && event_pop(&queue, &event)) {
+        long next;
+        virtual_ns = event.time;
+
+        switch (event.type) {
+            case EV_TICK:
+                consume_energy(1);
+                check_termination();
+                next = event.time + tick_period;
+                break;
+            case EV_FEED:
+                for (int i = 0; i < config.n_nuovi_atomi; i++) {
+                    if (create_atom(rng_range(&feed_rng, config.n_atom_max) + 1) != 0) {
+                        stop_simulation(stats, TERM_MELTDOWN);
+                        break;
+                    }
+                }
+                next = event.time + config.step;
+                break;
+            case EV_ACTIVATE: {
+                int count = config.activation_control == CONTROL_ENERGY
+                                ? controller_activations(stats)
+                                : activations_for_tick(&carry, &activation_rng);
+                if (stats_atom_count(stats) > 0 && count > 0) {
+                    update_stats_activations(stats, count);
+                    engine_activate(count, &engine_rng);
+                }
+                next = event.time + activation_period;
+                break;
+            }
+            case EV_TELEMETRY:
+                telemetry_write(stats, msg_id, virtual_ns);
+                next = event.time + config.telemetry_ms * 1000000L;
+                break;
+            default:
+                print_stats();
+                next = event.time + 1000000000L;
+                break;
+        }
+
+        /* A period of 0 would repeat the event forever at the same instant
+         * (load_config rejects STEP <= 0; this keeps every period honest) */
+        if (next <= event.time) {
+            fprintf(stderr, "Event %d does not advance virtual time\n", event.type);
+            exit(EXIT_FAILURE);
+        }
+        if (event_push(&queue, next, event.type) == -1) {
+            fprintf(stderr, "Failed to schedule an event\n");
+            stop_simulation(stats, TERM_MELTDOWN);
+        }
+    }
+
+    event_queue_free(&queue);
 }
 
 int main(void) {
     /* Load configuration */
     load_config();
 
+    /* Pick the seed of the run and hand it to attivatore and alimentazione
+     * through the environment, so that the run can be repeated */
+    if (config.seed == 0) {
+        config.seed = (monotonic_ns() ^ getpid()) & 0x7fffffffffffL;
+        if (config.seed == 0) {
+            config.seed = 1;
+        }
+        char seed_str[32];
+        snprintf(seed_str, sizeof(seed_str), "%ld", config.seed);
+        setenv("SEED", seed_str, 1);
+    }
+
     printf("Chain Reaction Simulation\n");
     printf("Configuration:\n");
     printf("  N_ATOMI_INIT: %d\n", config.n_atomi_init);
@@ -173,9 +761,27 @@ int main(void) {
     printf("  SIM_DURATION: %ld seconds\n", config.sim_duration);
     printf("  STEP: %ld nanoseconds\n", config.step);
     printf("  N_NUOVI_ATOMI: %d\n", config.n_nuovi_atomi);
+    printf("  TICK_MS: %d\n", config.tick_ms);
+    if (config.activation_control == CONTROL_ENERGY) {
+        printf("  ACTIVATION_CONTROL: energy in [%d, %d]\n",
+               config.energy_band_low, config.energy_band_high);
+    }
+    printf("  SEED: %ld\n", config.seed);
+    printf("  TIME_MODE: %s\n", config.time_mode == TIME_VIRTUAL ? "virtual" : "real");
+    printf("  SPAWN_MODE: %s\n", config.spawn_mode == SPAWN_EXEC ? "exec" : "fork");
+    printf("  ATOM_POOL_SIZE: %d\n", config.atom_pool_size);
+    printf("  TRANSPORT: %s\n", config.transport == TRANSPORT_RING ? "ring" : "msgqueue");
+    printf("  ENGINE_THREADS: %d%s\n", config.engine_threads,
+           config.engine_threads > 0 ? "" : " (one process per atom)");
     printf("\n");
 
-    /* Create IPC resources */
+    /* Clean up after crashed runs; live runs keep theirs */
+    int stale = remove_stale_ipc();
+    if (stale > 0) {
+        printf("Removed the IPC resources of %d crashed run(s)\n", stale);
+    }
+
+    /* Create IPC resources, private to this run */
     shm_id = create_shared_memory();
     if (shm_id == -1) {
         fprintf(stderr, "Failed to create shared memory\n");
@@ -206,6 +812,27 @@ int main(void) {
         exit(EXIT_FAILURE);
     }
 
+    /* Adopt the atoms orphaned by their parents so they are reaped too */
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        perror("prctl PR_SET_CHILD_SUBREAPER");
+    }
+
+    /* Lead a process group of our own before the first fork, so that the
+     * shutdown can signal the descendants without hitting the script that
+     * started us (a session leader already is one) */
+    if (setpgid(0, 0) == 0 || getpgrp() == getpid()) {
+        own_group = 1;
+    } else {
+        perror("setpgid");
+    }
+
+    /* SIGCHLD is only taken from the signalfd of the main loop; blocked
+     * before any thread or child exists, so that none of them gets it */
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
     /* Register cleanup */
     atexit(cleanup_ipc);
     signal(SIGINT, signal_handler);
@@ -213,103 +840,100 @@ int main(void) {
 
     /* Initialize shared memory */
     memset(stats, 0, sizeof(Statistics));
-    stats->running = 0;
-    stats->termination_cause = TERM_NONE;
-    stats->num_atoms = 0;
-    stats->init_count = 0;
+    stats->master_pid = getpid();
+    stats->sem_id = sem_id;
+    stats->msg_id = msg_id;
+    stats->magic = SIM_MAGIC;
+    stats->population_width = population_width_for(config.n_atom_max);
+    init_bin_potential();
+    admission_init(stats);
     stats->init_target = config.n_atomi_init + 2; /* atoms + attivatore + alimentazione */
+    if (config.engine_threads > 0) {
+        stats->init_target = 2; /* atoms are not processes */
+    }
 
     /* Initialize semaphores */
     init_semaphores(sem_id);
 
+    /* Select the message transport */
+    init_message_ring(&stats->ring);
+    init_message_ring(&stats->pool.assignments);
+    set_message_transport(stats, config.transport);
+
     /* Seed random number generator */
-    srand(time(NULL));
+    rng_seed(&rng, config.seed, RNG_STREAM_MASTER);
+
+    /* Start the worker pool of the in-process engine (none in virtual
+     * time, where the master drives the atom array itself) */
+    if ((config.engine_threads > 0 || config.time_mode == TIME_VIRTUAL) &&
+        engine_start(stats, sem_id, msg_id, config.engine_threads) == -1) {
+        fprintf(stderr, "Failed to start the engine\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Pre-fork the idle atoms of the pool; the initial atoms are taken
+     * from it and alimentazione refills it */
+    if (config.atom_pool_size > 0) {
+        printf("Pre-forking %d idle atoms...\n", config.atom_pool_size);
+        for (int i = 0; i < config.atom_pool_size; i++) {
+            int result = spawn_atom(0);
+            if (result == -1) {
+                fprintf(stderr, "Failed to pre-fork idle atom %d\n", i);
+                exit(EXIT_FAILURE);
+            }
+            if (result == 1) {
+                printf("Process budget reached after %d idle atoms\n", i);
+                break;
+            }
+            pool_spawned(stats, 1);
+        }
+    }
 
     /* Create initial atoms */
     printf("Creating %d initial atoms...\n", config.n_atomi_init);
     for (int i = 0; i < config.n_atomi_init; i++) {
-        int atomic_number = (rand() % config.n_atom_max) + 1;
+        int atomic_number = rng_range(&rng, config.n_atom_max) + 1;
 
-        if (create_atom(atomic_number) == -1) {
+        int result = create_atom(atomic_number);
+        if (result == -1) {
             fprintf(stderr, "Failed to create atom %d\n", i);
             exit(EXIT_FAILURE);
         }
+        if (result == 1) {
+            /* The start barrier only waits for the atoms that exist */
+            printf("Process budget reached after %d initial atoms\n", i);
+            update_stats_deferred_atoms(stats, config.n_atomi_init - i);
+            stats->init_target -= config.n_atomi_init - i;
+            break;
+        }
     }
 
-    /* Create attivatore process */
-    printf("Creating attivatore process...\n");
-    pid_t attivatore_pid = fork();
-    if (attivatore_pid == -1) {
-        perror("fork attivatore failed");
-        exit(EXIT_FAILURE);
-    } else if (attivatore_pid == 0) {
-        char shm_str[32], sem_str[32], msg_str[32];
-        snprintf(shm_str, sizeof(shm_str), "%d", shm_id);
-        snprintf(sem_str, sizeof(sem_str), "%d", sem_id);
-        snprintf(msg_str, sizeof(msg_str), "%d", msg_id);
-
-        execl("./attivatore", "attivatore", shm_str, sem_str, msg_str, (char*)NULL);
-        perror("execl attivatore failed");
+    /* Stream telemetry from the start */
+    if (config.telemetry != NULL && telemetry_open(config.telemetry) == -1) {
         exit(EXIT_FAILURE);
     }
 
-    /* Create alimentazione process */
-    printf("Creating alimentazione process...\n");
-    pid_t alimentazione_pid = fork();
-    if (alimentazione_pid == -1) {
-        perror("fork alimentazione failed");
-        exit(EXIT_FAILURE);
-    } else if (alimentazione_pid == 0) {
-        char shm_str[32], sem_str[32], msg_str[32];
-        snprintf(shm_str, sizeof(shm_str), "%d", shm_id);
-        snprintf(sem_str, sizeof(sem_str), "%d", sem_id);
-        snprintf(msg_str, sizeof(msg_str), "%d", msg_id);
-
-        execl("./alimentazione", "alimentazione", shm_str, sem_str, msg_str, (char*)NULL);
-        perror("execl alimentazione failed");
-        exit(EXIT_FAILURE);
-    }
+    if (config.time_mode == TIME_VIRTUAL) {
+        printf("Running in virtual time...\n\n");
+        run_virtual();
+    } else {
+        start_helpers();
 
-    /* Wait for all processes to initialize */
-    printf("Waiting for all processes to initialize...\n");
-    while (1) {
-        sem_wait_op(sem_id, SEM_STATS);
-        int init_count = stats->init_count;
-        sem_signal_op(sem_id, SEM_STATS);
+        /* Wait for all processes to initialize */
+        printf("Waiting for all processes to initialize...\n");
+        wait_for_init(stats);
 
-        if (init_count >= stats->init_target) {
-            break;
-        }
+        printf("All processes initialized. Starting simulation...\n\n");
 
-        usleep(100000); /* 100ms */
+        run_realtime();
     }
 
-    printf("All processes initialized. Starting simulation...\n\n");
-
-    /* Start simulation */
-    stats->running = 1;
-    start_time = time(NULL);
-
-    /* Main loop */
-    while (1) {
-        /* Sleep for 1 second */
-        sleep(1);
-
-        /* Print statistics */
-        print_stats();
-
-        /* Consume energy */
-        consume_energy();
-
-        /* Check termination conditions */
-        if (check_termination()) {
-            break;
-        }
-    }
+    /* Stop the engine workers before reporting */
+    engine_stop();
 
     /* Print termination cause */
     printf("\n=== Simulation Terminated ===\n");
-    switch (stats->termination_cause) {
+    switch (atomic_load(&stats->termination_cause)) {
         case TERM_TIMEOUT:
             printf("Cause: TIMEOUT - Simulation duration reached\n");
             break;
@@ -330,6 +954,11 @@ int main(void) {
 
     /* Print final statistics */
     print_stats();
+    write_summary();
+
+    /* Last record with the final counters */
+    telemetry_write(stats, msg_id, elapsed_ns());
+    telemetry_close();
 
     return 0;
 }
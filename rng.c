@@ -0,0 +1,45 @@
+#include "rng.h"
+
+/* Expands a seed into well-mixed state words */
+static uint64_t splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed(Rng* rng, uint64_t seed, uint64_t stream) {
+    /* Mix the stream in first, so that nearby seeds and streams do not
+     * give overlapping sequences */
+    uint64_t x = stream;
+    x = seed ^ splitmix64(&x);
+
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&x);
+    }
+}
+
+uint64_t rng_next(Rng* rng) {
+    uint64_t* s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/* Multiply-shift instead of a modulo: no division, and the bias is below
+ * 2^-32 for the ranges used here */
+uint32_t rng_range(Rng* rng, uint32_t n) {
+    return (uint32_t)(((rng_next(rng) >> 32) * n) >> 32);
+}
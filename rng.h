@@ -0,0 +1,34 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+ * Seedable PRNG (xoshiro256**), one generator per process or thread.
+ *
+ * Every generator is seeded from the run's SEED and a stream number, so
+ * each role draws its own reproducible sequence whatever the others do.
+ */
+
+/* Stream numbers of the roles; engine workers use RNG_STREAM_ENGINE + index */
+enum {
+    RNG_STREAM_MASTER,
+    RNG_STREAM_ATTIVATORE,
+    RNG_STREAM_ALIMENTAZIONE,
+    RNG_STREAM_ENGINE
+};
+
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+/* Seed the generator of a stream */
+void rng_seed(Rng* rng, uint64_t seed, uint64_t stream);
+
+/* Next 64 random bits */
+uint64_t rng_next(Rng* rng);
+
+/* Uniform integer in [0, n), n > 0 */
+uint32_t rng_range(Rng* rng, uint32_t n);
+
+#endif
@@ -4,9 +4,28 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "config.h"
+#include "admission.h"
+
+/* Sleep while *addr == expected, until woken or until the absolute
+ * CLOCK_MONOTONIC deadline (NULL waits forever) */
+int futex_wait(_Atomic unsigned int* addr, unsigned int expected,
+               const struct timespec* deadline) {
+    return syscall(SYS_futex, (unsigned int*)addr, FUTEX_WAIT_BITSET, expected,
+                   deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+void futex_wake(_Atomic unsigned int* addr, int count) {
+    syscall(SYS_futex, (unsigned int*)addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
 
 int create_shared_memory(void) {
-    int shm_id = shmget(SHM_KEY, sizeof(Statistics), IPC_CREAT | IPC_EXCL | 0666);
+    int shm_id = shmget(IPC_PRIVATE, sizeof(Statistics), IPC_CREAT | 0600);
     if (shm_id == -1) {
         perror("shmget");
         return -1;
@@ -35,8 +54,49 @@ void destroy_shared_memory(int shm_id) {
     }
 }
 
+/* Remove the IPC sets of runs whose master is gone: our segments, marked
+ * with SIM_MAGIC, along with the semaphores and queue they record.
+ * Returns the number of sets removed. */
+int remove_stale_ipc(void) {
+    struct shm_info info;
+    int removed = 0;
+
+    int max_index = shmctl(0, SHM_INFO, (struct shmid_ds*)&info);
+    if (max_index == -1) {
+        perror("shmctl SHM_INFO");
+        return 0;
+    }
+
+    for (int i = 0; i <= max_index; i++) {
+        struct shmid_ds ds;
+        int shm_id = shmctl(i, SHM_STAT, &ds);
+
+        if (shm_id == -1 || ds.shm_segsz != sizeof(Statistics) || ds.shm_perm.uid != getuid()) {
+            continue;
+        }
+
+        Statistics* stats = shmat(shm_id, NULL, SHM_RDONLY);
+        if (stats == (Statistics*)-1) {
+            continue;
+        }
+        int stale = stats->magic == SIM_MAGIC &&
+                    kill(stats->master_pid, 0) == -1 && errno == ESRCH;
+        int sem_id = stats->sem_id;
+        int msg_id = stats->msg_id;
+        shmdt(stats);
+
+        if (stale) {
+            semctl(sem_id, 0, IPC_RMID);
+            msgctl(msg_id, IPC_RMID, NULL);
+            shmctl(shm_id, IPC_RMID, NULL);
+            removed++;
+        }
+    }
+    return removed;
+}
+
 int create_semaphores(void) {
-    int sem_id = semget(SEM_KEY, NUM_SEMS, IPC_CREAT | IPC_EXCL | 0666);
+    int sem_id = semget(IPC_PRIVATE, NUM_SEMS, IPC_CREAT | 0600);
     if (sem_id == -1) {
         perror("semget");
         return -1;
@@ -56,6 +116,17 @@ void init_semaphores(int sem_id) {
     }
 }
 
+/* Segment of the calling process, bound by set_message_transport; NULL
+ * until then, in which case nothing is measured */
+static Statistics* process_stats = NULL;
+
+/* Record the latency of an operation started at start */
+static void record_op(int op, long start) {
+    if (process_stats != NULL) {
+        stats_record(process_stats, op, monotonic_ns() - start);
+    }
+}
+
 void sem_wait_op(int sem_id, int sem_num) {
     struct sembuf sb;
     sb.sem_num = sem_num;
@@ -89,7 +160,7 @@ void destroy_semaphores(int sem_id) {
 }
 
 int create_message_queue(void) {
-    int msg_id = msgget(MSG_KEY, IPC_CREAT | IPC_EXCL | 0666);
+    int msg_id = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
     if (msg_id == -1) {
         perror("msgget");
         return -1;
@@ -97,31 +168,242 @@ int create_message_queue(void) {
     return msg_id;
 }
 
+/* Shared-memory ring used instead of the queue, NULL for the queue */
+static MessageRing* ring = NULL;
+
+void init_message_ring(MessageRing* r) {
+    for (unsigned long i = 0; i < RING_SIZE; i++) {
+        atomic_store(&r->cells[i].seq, i);
+    }
+    atomic_store(&r->head, 0);
+    atomic_store(&r->tail, 0);
+}
+
+void set_message_transport(Statistics* stats, int transport) {
+    process_stats = stats;
+    ring = transport == TRANSPORT_RING ? &stats->ring : NULL;
+}
+
+static void count_send_failure(void) {
+    if (process_stats != NULL) {
+        atomic_fetch_add_explicit(&process_stats->send_failures, 1, memory_order_relaxed);
+    }
+}
+
+/* Bounded MPMC queue: every cell carries a sequence number telling
+ * producers and consumers whose turn it is. Never blocks; returns -1 with
+ * EAGAIN when the ring is full, otherwise the depth after the push. */
+static long ring_push(MessageRing* r, const Message* msg) {
+    unsigned long pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    RingCell* cell;
+
+    while (1) {
+        cell = &r->cells[pos & (RING_SIZE - 1)];
+        unsigned long seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long diff = (long)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+
+    cell->msg = *msg;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    /* Wake a consumer only if one is sleeping */
+    atomic_fetch_add(&r->items, 1);
+    if (atomic_load(&r->waiters) > 0) {
+        futex_wake(&r->items, 1);
+    }
+
+    return (long)(pos + 1 - atomic_load_explicit(&r->tail, memory_order_relaxed));
+}
+
+static int ring_pop(MessageRing* r, Message* msg) {
+    unsigned long pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    RingCell* cell;
+
+    while (1) {
+        cell = &r->cells[pos & (RING_SIZE - 1)];
+        unsigned long seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long diff = (long)(seq - (pos + 1));
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+
+    *msg = cell->msg;
+    atomic_store_explicit(&cell->seq, pos + RING_SIZE, memory_order_release);
+    return 1;
+}
+
+/* Take the next message, sleeping on the ring's futex while it is empty.
+ * Fails with EINTR once the simulation has stopped. */
+static int ring_receive(Statistics* stats, MessageRing* r, Message* msg) {
+    while (1) {
+        /* Read the generation before the run state: stop_simulation bumps
+         * it after the store, so the futex_wait below cannot miss the stop */
+        unsigned int seen = atomic_load(&r->items);
+
+        if (atomic_load(&stats->running) == RUN_STOPPED) {
+            break;
+        }
+        if (ring_pop(r, msg)) {
+            return 0;
+        }
+
+        atomic_fetch_add(&r->waiters, 1);
+        futex_wait(&r->items, seen, NULL);
+        atomic_fetch_sub(&r->waiters, 1);
+    }
+    errno = EINTR;
+    return -1;
+}
+
+/* Send on the transport ring, counting failures and the peak depth. With
+ * IPC_NOWAIT in flags a full ring fails with EAGAIN and is not counted:
+ * the caller keeps the message. */
+static int ring_send(const Message* msg, int flags) {
+    long depth = ring_push(ring, msg);
+
+    if (depth == -1) {
+        if (flags & IPC_NOWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+        count_send_failure();
+        return -1;
+    }
+
+    long peak = atomic_load_explicit(&process_stats->queue_peak, memory_order_relaxed);
+    while (depth > peak &&
+           !atomic_compare_exchange_weak(&process_stats->queue_peak, &peak, depth)) {
+    }
+    return 0;
+}
+
+/* Post msg; flags is 0 or IPC_NOWAIT, in which case a full queue or
+ * ring fails with EAGAIN without counting a send failure */
+static int post_message(int msg_id, const Message* msg, int flags) {
+    long start = monotonic_ns();
+
+    if (ring != NULL) {
+        int result = ring_send(msg, flags);
+        record_op(OP_SEND, start);
+        return result;
+    }
+
+    /* SysV IPC calls are never restarted after a signal handler */
+    while (msgsnd(msg_id, msg, sizeof(Message) - sizeof(long), flags) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EIDRM && errno != EINVAL && errno != EAGAIN) {
+            perror("msgsnd");
+            count_send_failure();
+        }
+        return -1;
+    }
+    record_op(OP_SEND, start);
+    return 0;
+}
+
 int send_message(int msg_id, long mtype, pid_t target_pid, int value) {
     Message msg;
     msg.mtype = mtype;
     msg.target_pid = target_pid;
     msg.value = value;
+    msg.sent_ns = monotonic_ns();
 
-    if (msgsnd(msg_id, &msg, sizeof(Message) - sizeof(long), 0) == -1) {
-        if (errno != EIDRM && errno != EINVAL) {
+    return post_message(msg_id, &msg, 0);
+}
+
+/* Send a copy of msg carrying value instead, keeping its send time. Never
+ * blocks: fails with EAGAIN when the queue is full. */
+int forward_message(int msg_id, const Message* msg, int value) {
+    Message copy = *msg;
+    copy.value = value;
+
+    return post_message(msg_id, &copy, IPC_NOWAIT);
+}
+
+/* Like send_message, but fails with EAGAIN instead of blocking when the
+ * queue is full */
+int try_send_message(int msg_id, long mtype, pid_t target_pid, int value) {
+    Message msg;
+    msg.mtype = mtype;
+    msg.target_pid = target_pid;
+    msg.value = value;
+    msg.sent_ns = monotonic_ns();
+
+    if (ring != NULL) {
+        return ring_send(&msg, 0);
+    }
+
+    if (msgsnd(msg_id, &msg, sizeof(Message) - sizeof(long), IPC_NOWAIT) == -1) {
+        if (errno != EAGAIN && errno != EIDRM && errno != EINVAL) {
             perror("msgsnd");
         }
+        if (errno != EIDRM && errno != EINVAL) {
+            count_send_failure();
+        }
         return -1;
     }
     return 0;
 }
 
+/* With the ring, mtype is not used for filtering: each engine has a single
+ * kind of reader, which handles every type it can be sent */
 int receive_message(int msg_id, Message* msg, long mtype) {
+    long start = monotonic_ns();
+
+    if (ring != NULL) {
+        if (ring_receive(process_stats, ring, msg) == -1) {
+            return -1;
+        }
+        record_op(OP_RECEIVE, start);
+        return 0;
+    }
+
     if (msgrcv(msg_id, msg, sizeof(Message) - sizeof(long), mtype, 0) == -1) {
         if (errno != EIDRM && errno != EINVAL && errno != EINTR) {
             perror("msgrcv");
         }
         return -1;
     }
+    record_op(OP_RECEIVE, start);
     return 0;
 }
 
+/* Messages waiting to be received */
+long message_queue_depth(int msg_id) {
+    if (ring != NULL) {
+        return (long)(atomic_load(&ring->head) - atomic_load(&ring->tail));
+    }
+
+    struct msqid_ds info;
+    if (msgctl(msg_id, IPC_STAT, &info) == -1) {
+        return -1;
+    }
+    return (long)info.msg_qnum;
+}
+
 void destroy_message_queue(int msg_id) {
     if (msgctl(msg_id, IPC_RMID, NULL) == -1) {
         if (errno != EIDRM && errno != EINVAL) {
@@ -130,32 +412,712 @@ void destroy_message_queue(int msg_id) {
     }
 }
 
-void update_stats_energy(Statistics* stats, int sem_id, long energy) {
-    sem_wait_op(sem_id, SEM_STATS);
-    stats->total_energy_produced += energy;
-    stats->last_sec_energy_produced += energy;
-    stats->current_energy += energy;
-    sem_signal_op(sem_id, SEM_STATS);
+/* Count this process in the start barrier; the last one wakes the master */
+void signal_init_done(Statistics* stats) {
+    unsigned int count = atomic_fetch_add(&stats->init_count, 1) + 1;
+    if ((int)count == stats->init_target) {
+        futex_wake(&stats->init_count, 1);
+    }
+}
+
+void wait_for_init(Statistics* stats) {
+    unsigned int count;
+    while ((int)(count = atomic_load(&stats->init_count)) < stats->init_target) {
+        futex_wait(&stats->init_count, count, NULL);
+    }
+}
+
+void wait_for_start(Statistics* stats) {
+    while (atomic_load(&stats->running) == RUN_WAITING) {
+        futex_wait(&stats->running, RUN_WAITING, NULL);
+    }
+}
+
+void start_simulation(Statistics* stats) {
+    atomic_store(&stats->running, RUN_RUNNING);
+    futex_wake(&stats->running, INT_MAX);
+}
+
+/* Record the termination cause (unless one is already set) and wake
+ * everybody sleeping on the run state */
+void stop_simulation(Statistics* stats, TerminationCause cause) {
+    int none = TERM_NONE;
+    if (cause != TERM_NONE) {
+        atomic_compare_exchange_strong(&stats->termination_cause, &none, cause);
+    }
+    atomic_store(&stats->running, RUN_STOPPED);
+    futex_wake(&stats->running, INT_MAX);
+
+    /* Change every futex word before waking it: a waiter that checked the
+     * run state just before the store above still sleeps on the old value */
+    atomic_fetch_add(&stats->ring.items, 1);
+    futex_wake(&stats->ring.items, INT_MAX);
+    atomic_fetch_add(&stats->pool.assignments.items, 1);
+    futex_wake(&stats->pool.assignments.items, INT_MAX);
+    atomic_fetch_or(&stats->pool.available, FUTEX_STOPPED);
+    futex_wake(&stats->pool.available, INT_MAX);
+    atomic_fetch_add(&stats->admission.released, 1);
+    futex_wake(&stats->admission.released, INT_MAX);
+
+    /* Atoms waiting for targeted activations sleep on their mailbox */
+    int used = atom_table_used(stats);
+    for (int i = 0; i < used; i++) {
+        atomic_fetch_or(&stats->atoms[i].mailbox, FUTEX_STOPPED);
+        futex_wake(&stats->atoms[i].mailbox, INT_MAX);
+    }
+}
+
+int is_running(Statistics* stats) {
+    return atomic_load(&stats->running) == RUN_RUNNING;
+}
+
+/* Sleep until the CLOCK_MONOTONIC deadline, returning early (with 0) as
+ * soon as the simulation stops. Returns 1 if the deadline passed while
+ * running. */
+int sleep_until_running(Statistics* stats, long deadline_ns) {
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000L,
+        .tv_nsec = deadline_ns % 1000000000L,
+    };
+
+    while (is_running(stats)) {
+        if (futex_wait(&stats->running, RUN_RUNNING, &deadline) == -1 && errno == ETIMEDOUT) {
+            return is_running(stats);
+        }
+    }
+    return 0;
+}
+
+/* Sleep for the given time, returning early (with 0) as soon as the
+ * simulation stops. Returns 1 if the whole time elapsed while running. */
+int sleep_while_running(Statistics* stats, long nanoseconds) {
+    return sleep_until_running(stats, monotonic_ns() + nanoseconds);
+}
+
+void schedule_start(Schedule* schedule, long period_ns) {
+    schedule->period_ns = period_ns;
+    schedule->next_ns = monotonic_ns() + period_ns;
+}
+
+int schedule_wait(Statistics* stats, Schedule* schedule) {
+    if (!sleep_until_running(stats, schedule->next_ns)) {
+        return 0;
+    }
+
+    long lag = monotonic_ns() - schedule->next_ns;
+    stats_record(stats, OP_TICK_LAG, lag);
+
+    /* The deadlines stay on the grid of the start, whatever the policy */
+    int due = 1 + (int)(lag / schedule->period_ns);
+    schedule->next_ns += due * schedule->period_ns;
+    return config.schedule_policy == SCHEDULE_CATCHUP ? due : 1;
+}
+
+long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int hist_bucket(long ns) {
+    unsigned long v = ns > 0 ? (unsigned long)ns : 0;
+
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Largest value falling in bucket i */
+static long hist_bucket_max(int i) {
+    if (i < HIST_SUB) {
+        return i;
+    }
+    int shift = i / HIST_SUB - 1;
+    return ((long)(HIST_SUB + i % HIST_SUB) << shift) + (1L << shift) - 1;
+}
+
+void hist_record(Histogram* h, long ns) {
+    atomic_fetch_add_explicit(&h->buckets[hist_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+
+    long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak(&h->max, &max, ns)) {
+    }
+}
+
+/* Upper bound of the bucket holding the given percentile (0-100), capped
+ * at the largest value seen. 0 if nothing was recorded. */
+long hist_percentile(Histogram* h, double percentile) {
+    long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    long rank = (long)(count * percentile / 100.0 + 0.5);
+    long seen = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= rank) {
+            long bound = hist_bucket_max(i);
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+void record_activation_latency(Statistics* stats, long sent_ns) {
+    stats_record(stats, OP_ACTIVATION, monotonic_ns() - sent_ns);
+}
+
+static int population_bin(Statistics* stats, int atomic_number);
+
+static int lowest_bit(uint64_t word) {
+    return __builtin_ctzll(word);
+}
+
+static int highest_bit(uint64_t word) {
+    return 63 - __builtin_clzll(word);
+}
+
+static void atom_index_add(Statistics* stats, int index, int atomic_number) {
+    AtomIndex* ai = &stats->atom_index;
+    int b = population_bin(stats, atomic_number);
+    int w = index / 64;
+
+    atomic_fetch_or(&ai->bin[b].words[w], 1ULL << (index % 64));
+    atomic_fetch_or(&ai->bin[b].summary[w / 64], 1ULL << (w % 64));
+    atomic_fetch_or(&ai->bins[b / 64], 1ULL << (b % 64));
+}
+
+/* Clear bit of *summary if *child is empty, setting it again if an add
+ * refilled child in between. Returns 1 if the bit stays cleared. */
+static int atom_index_clear_summary(_Atomic uint64_t* summary, uint64_t bit, _Atomic uint64_t* child,
+                                    int children) {
+    atomic_fetch_and(summary, ~bit);
+    for (int i = 0; i < children; i++) {
+        if (atomic_load(&child[i]) != 0) {
+            atomic_fetch_or(summary, bit);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void atom_index_remove(Statistics* stats, int index, int atomic_number) {
+    AtomIndex* ai = &stats->atom_index;
+    int b = population_bin(stats, atomic_number);
+    int w = index / 64;
+    AtomIndexBin* bin = &ai->bin[b];
+
+    if ((atomic_fetch_and(&bin->words[w], ~(1ULL << (index % 64))) & ~(1ULL << (index % 64))) != 0) {
+        return;
+    }
+    if (!atom_index_clear_summary(&bin->summary[w / 64], 1ULL << (w % 64), &bin->words[w], 1)) {
+        return;
+    }
+    for (int i = 0; i < ATOM_INDEX_SUMMARY; i++) {
+        if (atomic_load(&bin->summary[i]) != 0) {
+            return;
+        }
+    }
+    atom_index_clear_summary(&ai->bins[b / 64], 1ULL << (b % 64), bin->summary, ATOM_INDEX_SUMMARY);
+}
+
+/* Pop an entry off the free list, -1 if it is empty */
+static int atom_free_pop(Statistics* stats) {
+    uint64_t head = atomic_load(&stats->atoms_free);
+
+    for (;;) {
+        int index = ATOM_FREE_INDEX(head);
+        if (index < 0) {
+            return -1;
+        }
+        /* A stale next is harmless: the tag makes the exchange fail */
+        int next = atomic_load(&stats->atoms[index].next_free);
+        uint64_t popped = ATOM_FREE_HEAD((head >> 32) + 1, next);
+        if (atomic_compare_exchange_weak(&stats->atoms_free, &head, popped)) {
+            return index;
+        }
+    }
+}
+
+static void atom_free_push(Statistics* stats, int index) {
+    uint64_t head = atomic_load(&stats->atoms_free);
+
+    do {
+        atomic_store(&stats->atoms[index].next_free, ATOM_FREE_INDEX(head));
+    } while (!atomic_compare_exchange_weak(&stats->atoms_free, &head,
+                                           ATOM_FREE_HEAD(head >> 32, index)));
+}
+
+/* Take a free entry in O(1): off the free list, or the next never used
+ * one. Returns NULL when the table is full. */
+AtomSlot* atom_table_claim(Statistics* stats, pid_t pid, int atomic_number) {
+    int index = atom_free_pop(stats);
+
+    if (index < 0) {
+        int used = atomic_load(&stats->atoms_used);
+        do {
+            if (used >= ATOM_TABLE_SIZE) {
+                return NULL;
+            }
+        } while (!atomic_compare_exchange_weak(&stats->atoms_used, &used, used + 1));
+        index = used;
+    }
+
+    AtomSlot* slot = &stats->atoms[index];
+    atomic_store(&slot->mailbox, 0);
+    atomic_store(&slot->atomic_number, atomic_number);
+    atomic_store(&slot->state, ATOM_WAITING);
+    slot->birth = monotonic_ns();
+    atomic_store(&slot->pid, pid);
+    atom_index_add(stats, index, atomic_number);
+    return slot;
+}
+
+/* Free the slot. Activations still in its mailbox die with the atom. */
+void atom_table_release(Statistics* stats, AtomSlot* slot) {
+    atom_index_remove(stats, (int)(slot - stats->atoms), atomic_load(&slot->atomic_number));
+    atomic_store(&slot->pid, 0);
+    atomic_store(&slot->state, ATOM_FREE);
+    atom_free_push(stats, (int)(slot - stats->atoms));
+}
+
+/* Entries ever handed out; every live atom has an index below */
+int atom_table_used(Statistics* stats) {
+    return atomic_load(&stats->atoms_used);
+}
+
+void atom_table_renumber(Statistics* stats, AtomSlot* slot, int atomic_number) {
+    int index = (int)(slot - stats->atoms);
+    int old = atomic_exchange(&slot->atomic_number, atomic_number);
+
+    if (population_bin(stats, old) != population_bin(stats, atomic_number)) {
+        atom_index_add(stats, index, atomic_number);
+        atom_index_remove(stats, index, old);
+    }
+}
+
+/* Entries of one bin with at least min_number, in table order */
+static int atom_index_collect_bin(Statistics* stats, AtomIndexBin* bin, int min_number,
+                                  AtomSlot** targets, int max) {
+    int n = 0;
+
+    for (int s = 0; s < ATOM_INDEX_SUMMARY && n < max; s++) {
+        uint64_t summary = atomic_load(&bin->summary[s]);
+        while (summary != 0 && n < max) {
+            int w = s * 64 + lowest_bit(summary);
+            uint64_t word = atomic_load(&bin->words[w]);
+            while (word != 0 && n < max) {
+                AtomSlot* slot = &stats->atoms[w * 64 + lowest_bit(word)];
+                if (atomic_load_explicit(&slot->atomic_number, memory_order_relaxed) >= min_number) {
+                    targets[n++] = slot;
+                }
+                word &= word - 1;
+            }
+            summary &= summary - 1;
+        }
+    }
+    return n;
+}
+
+int atom_index_collect(Statistics* stats, int smallest, AtomSlot** targets, int max) {
+    AtomIndex* ai = &stats->atom_index;
+    int first = population_bin(stats, config.min_n_atomico + 1);
+    int n = 0;
+
+    if (smallest) {
+        for (int g = first / 64; g < POPULATION_BINS / 64 && n < max; g++) {
+            uint64_t bins = atomic_load(&ai->bins[g]);
+            if (g == first / 64) {
+                bins &= ~0ULL << (first % 64);
+            }
+            for (; bins != 0 && n < max; bins &= bins - 1) {
+                n += atom_index_collect_bin(stats, &ai->bin[g * 64 + lowest_bit(bins)],
+                                            config.min_n_atomico + 1, targets + n, max - n);
+            }
+        }
+    } else {
+        for (int g = POPULATION_BINS / 64 - 1; g >= 0 && n < max; g--) {
+            uint64_t bins = atomic_load(&ai->bins[g]);
+            while (bins != 0 && n < max) {
+                int b = highest_bit(bins);
+                n += atom_index_collect_bin(stats, &ai->bin[g * 64 + b], 0, targets + n, max - n);
+                bins &= ~(1ULL << b);
+            }
+        }
+    }
+    return n;
+}
+
+/* Post activations to the atom owning the slot, if it is still pid */
+int deliver_activations(AtomSlot* slot, pid_t pid, int count) {
+    if (atomic_load(&slot->pid) != pid) {
+        return -1;
+    }
+    if (atomic_load(&slot->mailbox) == 0) {
+        atomic_store(&slot->activated_ns, monotonic_ns());
+    }
+    atomic_fetch_add(&slot->mailbox, count);
+    futex_wake(&slot->mailbox, 1);
+    return 0;
+}
+
+/* Sleep until an activation is in the mailbox and take it. Returns 1 with
+ * an activation, 0 when the simulation stopped. */
+int wait_for_activation(Statistics* stats, AtomSlot* slot) {
+    while (is_running(stats)) {
+        unsigned int pending = atomic_load(&slot->mailbox);
+
+        if (pending & FUTEX_STOPPED) {
+            break;
+        }
+        if (pending == 0) {
+            futex_wait(&slot->mailbox, 0, NULL);
+        } else if (atomic_compare_exchange_weak(&slot->mailbox, &pending, pending - 1)) {
+            /* Measured from the oldest activation still pending */
+            record_activation_latency(stats, atomic_load(&slot->activated_ns));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Account for idle atoms just forked into the pool */
+void pool_spawned(Statistics* stats, int count) {
+    atomic_fetch_add(&stats->pool.available, count);
+}
+
+/* Hand an atomic number to an idle atom of the pool. Returns -1 if the pool
+ * is empty, in which case the caller spawns the atom itself. */
+int pool_assign(Statistics* stats, int atomic_number) {
+    unsigned int available = atomic_load(&stats->pool.available);
+    Message msg;
+
+    do {
+        if (available == 0 || (available & FUTEX_STOPPED)) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&stats->pool.available, &available, available - 1));
+
+    msg.mtype = MSG_NEW_ATOM;
+    msg.target_pid = 0;
+    msg.value = atomic_number;
+    msg.sent_ns = 0;
+    if (ring_push(&stats->pool.assignments, &msg) == -1) {
+        atomic_fetch_add(&stats->pool.available, 1);
+        return -1;
+    }
+
+    /* Let the refiller replace the atom */
+    futex_wake(&stats->pool.available, 1);
+    return 0;
+}
+
+/* Idle atom: sleep until an atomic number is assigned. Returns 0 if the
+ * simulation stopped first. */
+int pool_wait_assignment(Statistics* stats) {
+    Message msg;
+
+    if (ring_receive(stats, &stats->pool.assignments, &msg) == -1) {
+        return 0;
+    }
+    return msg.value;
+}
+
+/* Refiller: sleep while the pool holds size atoms, then return how many
+ * are missing. Returns 0 once the simulation stopped. */
+int pool_wait_refill(Statistics* stats, int size) {
+    while (atomic_load(&stats->running) != RUN_STOPPED) {
+        unsigned int available = atomic_load(&stats->pool.available);
+
+        if (available & FUTEX_STOPPED) {
+            break;
+        }
+        if ((int)available < size) {
+            return size - (int)available;
+        }
+        futex_wait(&stats->pool.available, available, NULL);
+    }
+    return 0;
+}
+
+int activations_for_tick(int* carry, Rng* rng) {
+    if (config.activation_rate > 0) {
+        int count;
+        *carry += config.activation_rate;
+        count = *carry / ACTIVATION_TICKS_PER_SEC;
+        *carry %= ACTIVATION_TICKS_PER_SEC;
+        return count;
+    }
+    return rng_range(rng, 3) + 1;
+}
+
+/* Calculate energy from fission */
+long calculate_energy(int n1, int n2) {
+    int max_n = (n1 > n2) ? n1 : n2;
+    return (long)n1 * n2 - max_n;
+}
+
+long activation_yield(int atomic_number) {
+    if (atomic_number <= config.min_n_atomico) {
+        return 0;
+    }
+    int n1 = atomic_number / 2;
+    return calculate_energy(n1, atomic_number - n1);
 }
 
-void update_stats_split(Statistics* stats, int sem_id) {
-    sem_wait_op(sem_id, SEM_STATS);
-    stats->total_splits++;
-    stats->last_sec_splits++;
-    sem_signal_op(sem_id, SEM_STATS);
+/* Slot used by this thread, chosen from its thread id (the pid of a
+ * single-threaded process), so the engine workers do not share one */
+static _Thread_local int writer_slot = -1;
+
+/* Pick the counter slot of the calling thread. Must be called again in
+ * a forked child, otherwise it keeps writing to its parent's slot. */
+void stats_bind_writer(void) {
+    writer_slot = gettid() % STATS_SLOTS;
+}
+
+static StatsSlot* my_slot(Statistics* stats) {
+    if (writer_slot < 0) {
+        stats_bind_writer();
+    }
+    return &stats->slots[writer_slot];
+}
+
+const char* const stats_op_names[NUM_OPS] = { "activation", "send", "receive", "fork", "tick_lag" };
+
+void stats_record(Statistics* stats, int op, long ns) {
+    if (writer_slot < 0) {
+        stats_bind_writer();
+    }
+    hist_record(&stats->latency[writer_slot].ops[op], ns);
+}
+
+/* Sum the histograms of an operation over all the slots into merged */
+void stats_latency(Statistics* stats, int op, Histogram* merged) {
+    memset(merged, 0, sizeof(*merged));
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        Histogram* h = &stats->latency[i].ops[op];
+        long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+        /* Most slots are unused with few processes */
+        if (atomic_load_explicit(&h->count, memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        merged->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+        merged->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        if (max > merged->max) {
+            merged->max = max;
+        }
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            merged->buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+    }
+}
+
+void stats_snapshot(Statistics* stats, StatsSnapshot* snap) {
+    memset(snap, 0, sizeof(*snap));
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        StatsSlot* slot = &stats->slots[i];
+        snap->activations += atomic_load_explicit(&slot->activations, memory_order_relaxed);
+        snap->splits += atomic_load_explicit(&slot->splits, memory_order_relaxed);
+        snap->energy_produced += atomic_load_explicit(&slot->energy_produced, memory_order_relaxed);
+        snap->energy_consumed += atomic_load_explicit(&slot->energy_consumed, memory_order_relaxed);
+        snap->waste += atomic_load_explicit(&slot->waste, memory_order_relaxed);
+        snap->atoms += atomic_load_explicit(&slot->atoms, memory_order_relaxed);
+        snap->reaped += atomic_load_explicit(&slot->reaped, memory_order_relaxed);
+        snap->exit_failures += atomic_load_explicit(&slot->exit_failures, memory_order_relaxed);
+        snap->killed += atomic_load_explicit(&slot->killed, memory_order_relaxed);
+        snap->deferred_atoms += atomic_load_explicit(&slot->deferred_atoms, memory_order_relaxed);
+        snap->refused_splits += atomic_load_explicit(&slot->refused_splits, memory_order_relaxed);
+    }
+}
+
+long stats_current_energy(const StatsSnapshot* snap) {
+    return snap->energy_produced - snap->energy_consumed;
 }
 
-void update_stats_waste(Statistics* stats, int sem_id) {
-    sem_wait_op(sem_id, SEM_STATS);
-    stats->total_waste++;
-    stats->last_sec_waste++;
-    stats->num_atoms--;
-    sem_signal_op(sem_id, SEM_STATS);
+void update_stats_energy(Statistics* stats, long energy) {
+    atomic_fetch_add_explicit(&my_slot(stats)->energy_produced, energy, memory_order_relaxed);
+}
+
+void update_stats_consumed(Statistics* stats, long energy) {
+    atomic_fetch_add_explicit(&my_slot(stats)->energy_consumed, energy, memory_order_relaxed);
+}
+
+void update_stats_split(Statistics* stats) {
+    atomic_fetch_add_explicit(&my_slot(stats)->splits, 1, memory_order_relaxed);
+}
+
+void update_stats_waste(Statistics* stats) {
+    atomic_fetch_add_explicit(&my_slot(stats)->waste, 1, memory_order_relaxed);
+}
+
+void update_stats_activations(Statistics* stats, long count) {
+    atomic_fetch_add_explicit(&my_slot(stats)->activations, count, memory_order_relaxed);
+}
+
+void update_stats_deferred_atoms(Statistics* stats, long count) {
+    atomic_fetch_add_explicit(&my_slot(stats)->deferred_atoms, count, memory_order_relaxed);
+}
+
+void update_stats_refused_split(Statistics* stats) {
+    atomic_fetch_add_explicit(&my_slot(stats)->refused_splits, 1, memory_order_relaxed);
+}
+
+void stats_child_exited(Statistics* stats, int status) {
+    StatsSlot* slot = my_slot(stats);
+
+    admission_release(stats);
+    atomic_fetch_add_explicit(&slot->reaped, 1, memory_order_relaxed);
+    if (WIFSIGNALED(status)) {
+        atomic_fetch_add_explicit(&slot->killed, 1, memory_order_relaxed);
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) != EXIT_SUCCESS) {
+        atomic_fetch_add_explicit(&slot->exit_failures, 1, memory_order_relaxed);
+    }
+}
+
+int reap_exited_children(Statistics* stats) {
+    int reaped = 0;
+    int status;
+
+    while (waitpid(-1, &status, WNOHANG) > 0) {
+        stats_child_exited(stats, status);
+        reaped++;
+    }
+    return reaped;
+}
+
+static Statistics* reaper_stats;
+
+static void reaper_handler(int signum) {
+    int saved_errno = errno;
+    (void)signum;
+
+    reap_exited_children(reaper_stats);
+    errno = saved_errno;
+}
+
+int install_reaper(Statistics* stats) {
+    struct sigaction action;
+    sigset_t set;
+
+    reaper_stats = stats;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = reaper_handler;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, NULL) == -1) {
+        perror("sigaction SIGCHLD");
+        return -1;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    if (sigprocmask(SIG_UNBLOCK, &set, NULL) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    /* Children that exited before the handler was in place */
+    reap_exited_children(stats);
+    return 0;
+}
+
+int population_width_for(int n_atom_max) {
+    if (n_atom_max < 0) {
+        return 1;
+    }
+    return n_atom_max / POPULATION_BINS + 1;
+}
+
+static int population_bin(Statistics* stats, int atomic_number) {
+    if (atomic_number < 0) {
+        return 0;
+    }
+    int bin = atomic_number / (stats->population_width > 0 ? stats->population_width : 1);
+    return bin < POPULATION_BINS ? bin : POPULATION_BINS - 1;
+}
+
+static void population_add(Statistics* stats, int atomic_number, long delta) {
+    if (writer_slot < 0) {
+        stats_bind_writer();
+    }
+    atomic_fetch_add_explicit(&stats->population[writer_slot].count[population_bin(stats, atomic_number)],
+                              delta, memory_order_relaxed);
+}
+
+void stats_atom_born(Statistics* stats, int atomic_number) {
+    atomic_fetch_add_explicit(&my_slot(stats)->atoms, 1, memory_order_relaxed);
+    population_add(stats, atomic_number, 1);
+}
+
+/* The atom keeps the remaining part; the other part is born elsewhere */
+void stats_atom_split(Statistics* stats, int atomic_number, int remaining) {
+    population_add(stats, atomic_number, -1);
+    population_add(stats, remaining, 1);
+}
+
+void stats_atom_died(Statistics* stats, int atomic_number) {
+    atomic_fetch_add_explicit(&my_slot(stats)->atoms, -1, memory_order_relaxed);
+    population_add(stats, atomic_number, -1);
+}
+
+long stats_atom_count(Statistics* stats) {
+    long count = 0;
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        count += atomic_load_explicit(&stats->slots[i].atoms, memory_order_relaxed);
+    }
+    return count;
+}
+
+/* Sum the population slots. Transitions in flight can make a bin briefly
+ * off by one, never negative in the total of a quiet run. */
+void stats_population(Statistics* stats, long counts[POPULATION_BINS]) {
+    memset(counts, 0, POPULATION_BINS * sizeof(long));
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        for (int z = 0; z < POPULATION_BINS; z++) {
+            counts[z] += atomic_load_explicit(&stats->population[i].count[z], memory_order_relaxed);
+        }
+    }
+}
+
+/* Potential of k and k + 1 at once: the halves of both are h = k / 2 or
+ * h + 1, so each pair only needs the pair of h, O(log k) calls in all */
+static void split_potential_pair(int k, int min_n_atomico, long* pk, long* pk1) {
+    if (k <= 1) {
+        *pk = 0;
+        *pk1 = 0;
+    } else {
+        long ph, ph1;
+        int h = k / 2;
+        split_potential_pair(h, min_n_atomico, &ph, &ph1);
+        if (k % 2 == 0) {
+            *pk = calculate_energy(h, h) + 2 * ph;
+            *pk1 = calculate_energy(h, h + 1) + ph + ph1;
+        } else {
+            *pk = calculate_energy(h, h + 1) + ph + ph1;
+            *pk1 = calculate_energy(h + 1, h + 1) + 2 * ph1;
+        }
+    }
+    if (k <= min_n_atomico) {
+        *pk = 0;
+    }
+    if (k + 1 <= min_n_atomico) {
+        *pk1 = 0;
+    }
 }
 
-void update_stats_activation(Statistics* stats, int sem_id) {
-    sem_wait_op(sem_id, SEM_STATS);
-    stats->total_activations++;
-    stats->last_sec_activations++;
-    sem_signal_op(sem_id, SEM_STATS);
+long split_potential(int atomic_number, int min_n_atomico) {
+    long potential, next;
+    split_potential_pair(atomic_number, min_n_atomico, &potential, &next);
+    return potential;
 }
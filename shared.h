@@ -7,16 +7,30 @@
 #include <sys/sem.h>
 #include <sys/msg.h>
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "rng.h"
 
-/* Keys for IPC resources */
-#define SHM_KEY 0x1234
-#define SEM_KEY 0x5678
-#define MSG_KEY 0x9ABC
+#if defined(__linux__)
+/* glibc does not define semun (macOS does) */
+union semun {
+    int val;
+    struct semid_ds* buf;
+    unsigned short* array;
+};
+#endif
+
+/* IPC resources are created with IPC_PRIVATE, one set per run; the ids
+ * reach the other processes on their command line. SIM_MAGIC marks our
+ * segments so that the ones of crashed runs can be found and removed. */
+#define SIM_MAGIC 0x53494d31
 
 /* Message types */
-#define MSG_SPLIT 1
+#define MSG_SPLIT 1         /* value: number of activations carried (0 counts as 1) */
 #define MSG_INIT_DONE 2
 #define MSG_TERMINATE 3
+#define MSG_NEW_ATOM 4      /* In-process engine: value is the atomic number */
 
 /* Semaphore indices */
 #define SEM_STATS 0
@@ -24,47 +38,239 @@
 #define SEM_BARRIER 2
 #define NUM_SEMS 3
 
-/* Statistics structure in shared memory */
+/* Per-writer counter slots */
+#define CACHE_LINE 64
+#define STATS_SLOTS 64
+
+/* Counters of one writer slot, padded to a cache line so that writers
+ * hashed to different slots never share one */
 typedef struct {
-    long total_activations;
-    long total_splits;
-    long total_energy_produced;
-    long total_energy_consumed;
-    long total_waste;
-    long current_energy;
-
-    long last_sec_activations;
-    long last_sec_splits;
-    long last_sec_energy_produced;
-    long last_sec_energy_consumed;
-    long last_sec_waste;
-
-    int running;
-    int num_atoms;
-    int init_count;
-    int init_target;
-
-    enum {
-        TERM_NONE,
-        TERM_TIMEOUT,
-        TERM_EXPLODE,
-        TERM_BLACKOUT,
-        TERM_MELTDOWN
-    } termination_cause;
-} Statistics;
+    _Atomic long activations;
+    _Atomic long splits;
+    _Atomic long energy_produced;
+    _Atomic long energy_consumed;
+    _Atomic long waste;
+    _Atomic long atoms;                 /* Born minus died; only the sum over the slots is meaningful */
+    _Atomic long reaped;                /* Children reaped by the processes of this slot */
+    _Atomic long exit_failures;         /* ... that exited with a nonzero status */
+    _Atomic long killed;                /* ... that were terminated by a signal */
+    _Atomic long deferred_atoms;        /* New atoms postponed by admission control */
+    _Atomic long refused_splits;        /* Splits refused by admission control */
+} __attribute__((aligned(CACHE_LINE))) StatsSlot;
+
+/* Totals obtained by summing all the slots */
+typedef struct {
+    long activations;
+    long splits;
+    long energy_produced;
+    long energy_consumed;
+    long waste;
+    long atoms;
+    long reaped;
+    long exit_failures;
+    long killed;
+    long deferred_atoms;
+    long refused_splits;
+} StatsSnapshot;
+
+/* Live atoms by atomic number. Each bin covers population_width atomic
+ * numbers, chosen by the master from N_ATOM_MAX so that every number an
+ * atom can have falls in a bin; the last bin also counts anything larger */
+#define POPULATION_BINS 256
+
+/* Population changes of one writer slot, net of births and deaths */
+typedef struct {
+    _Atomic long count[POPULATION_BINS];
+} __attribute__((aligned(CACHE_LINE))) PopulationSlot;
+
+/* Latency histogram with log-linear buckets: values below HIST_SUB have
+ * their own bucket, above that every power of two is split in HIST_SUB
+ * buckets, so a bucket is at most 1/HIST_SUB of its values wide */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct {
+    _Atomic long count;
+    _Atomic long sum;
+    _Atomic long max;
+    _Atomic long buckets[HIST_BUCKETS];
+} Histogram;
+
+/* Instrumented operations */
+enum {
+    OP_ACTIVATION,                      /* Activation sent until an atom splits */
+    OP_SEND,                            /* Message sends, including a wait on a full queue */
+    OP_RECEIVE,                         /* receive_message, including the wait for a message */
+    OP_FORK,                            /* fork() of an atom, as seen by the parent */
+    OP_TICK_LAG,                        /* attivatore/alimentazione waking past their deadline */
+    NUM_OPS
+};
+
+/* Latency histograms of one writer slot, written like StatsSlot */
+typedef struct {
+    Histogram ops[NUM_OPS];
+} __attribute__((aligned(CACHE_LINE))) LatencySlot;
+
+/* Names of the instrumented operations, indexed by OP_* */
+extern const char* const stats_op_names[NUM_OPS];
+
+/* Capacity of the atom table */
+#define ATOM_TABLE_SIZE 32768
+
+/* States of an atom table entry */
+enum {
+    ATOM_FREE,                          /* On the free list, or never used */
+    ATOM_WAITING,                       /* Atom waiting for an activation */
+    ATOM_SPLITTING                      /* Atom splitting */
+};
+
+/* Entry of the atom table, one cache line each so that atoms updating
+ * their own entry never share a line. The mailbox counts the activations
+ * targeted at the atom and is the futex word it sleeps on. */
+typedef struct {
+    _Atomic pid_t pid;                  /* 0 = free */
+    _Atomic int atomic_number;
+    _Atomic int state;                  /* ATOM_* */
+    _Atomic int next_free;              /* Next entry of the free list, -1 = none */
+    long birth;                         /* CLOCK_MONOTONIC ns */
+    _Atomic unsigned int mailbox;
+    _Atomic long activated_ns;          /* When the mailbox last went from empty to pending */
+} __attribute__((aligned(CACHE_LINE))) AtomSlot;
+
+/* Index of the atom table by atomic number, in the population bins: a
+ * two-level bitmap of entries per bin and a bitmap of the bins holding
+ * any, so the largest or smallest atoms are found with a few bit scans
+ * instead of a scan of the table. Bits are set before their summary bit
+ * and a cleared summary bit is set again if its word refilled meanwhile,
+ * so a summary bit may point to nothing but never misses an entry. */
+#define ATOM_INDEX_WORDS (ATOM_TABLE_SIZE / 64)
+#define ATOM_INDEX_SUMMARY (ATOM_INDEX_WORDS / 64)
+
+typedef struct {
+    _Atomic uint64_t summary[ATOM_INDEX_SUMMARY];   /* bit w: words[w] != 0 */
+    _Atomic uint64_t words[ATOM_INDEX_WORDS];       /* bit i: entry i is in the bin */
+} __attribute__((aligned(CACHE_LINE))) AtomIndexBin;
+
+typedef struct {
+    _Atomic uint64_t bins[POPULATION_BINS / 64];    /* bit b: bin b holds entries */
+    AtomIndexBin bin[POPULATION_BINS];
+} AtomIndex;
+
+/* Head of the free list of the atom table: an index and a tag bumped by
+ * every pop, so that a pop racing with a pop and a push of the same entry
+ * fails its compare-and-swap (ABA) */
+#define ATOM_FREE_INDEX(head) ((int)((head) & 0xffffffffu) - 1)
+#define ATOM_FREE_HEAD(tag, index) (((uint64_t)(tag) << 32) | (uint32_t)((index) + 1))
 
 /* Message structure */
 typedef struct {
     long mtype;
     pid_t target_pid;
     int value;
+    long sent_ns;                       /* CLOCK_MONOTONIC send time of the activation */
 } Message;
 
+/* Shared-memory ring of messages (TRANSPORT=ring), a power of two */
+#define RING_SIZE 4096
+
+typedef struct {
+    _Atomic unsigned long seq;
+    Message msg;
+} RingCell;
+
+typedef struct {
+    _Atomic unsigned long head __attribute__((aligned(CACHE_LINE)));
+    _Atomic unsigned long tail __attribute__((aligned(CACHE_LINE)));
+    _Atomic unsigned int items __attribute__((aligned(CACHE_LINE))); /* futex word, bumped per send */
+    _Atomic unsigned int waiters;
+    RingCell cells[RING_SIZE];
+} MessageRing;
+
+/* Fork admission control, see admission.h */
+typedef struct {
+    _Atomic long processes __attribute__((aligned(CACHE_LINE))); /* reserved, released when reaped */
+    long budget;                        /* splits are admitted up to here */
+    long inject_limit;                  /* new atoms up to here */
+    _Atomic long backlog;               /* new atoms alimentazione still owes */
+    _Atomic unsigned int released;      /* futex word, bumped when a process is released */
+    _Atomic unsigned int waiters;       /* splits sleeping for a released process */
+} Admission;
+
+/* Pre-forked idle atom processes (ATOM_POOL_SIZE) */
+typedef struct {
+    _Atomic unsigned int available;     /* spawned, not assigned yet; futex word of the refiller */
+    MessageRing assignments;            /* value: atomic number handed to an idle atom */
+} AtomPool;
+
+/* Values of Statistics.running */
+#define RUN_WAITING 0
+#define RUN_RUNNING 1
+#define RUN_STOPPED 2
+
+/* Set by stop_simulation in the mailbox and pool futex words, so that a
+ * waiter which read the word just before the stop fails its futex_wait
+ * instead of sleeping through the wake-up */
+#define FUTEX_STOPPED 0x80000000u
+
+typedef enum {
+    TERM_NONE,
+    TERM_TIMEOUT,
+    TERM_EXPLODE,
+    TERM_BLACKOUT,
+    TERM_MELTDOWN
+} TerminationCause;
+
+/* Statistics structure in shared memory */
+typedef struct {
+    /* Owner of the IPC set, written by the master after creation */
+    unsigned int magic;
+    pid_t master_pid;
+    int sem_id;
+    int msg_id;
+
+    StatsSlot slots[STATS_SLOTS];
+
+    /* Futex words: processes sleep on them instead of polling */
+    _Atomic unsigned int running;
+    _Atomic unsigned int init_count;
+
+    _Atomic int init_target;            /* lowered for atoms admission control defers */
+
+    _Atomic int termination_cause; /* TerminationCause, first one wins */
+
+    /* Message transport */
+    _Atomic long send_failures;
+    _Atomic long queue_peak;
+    MessageRing ring;
+
+    AtomPool pool;
+
+    Admission admission;
+
+    /* Live atoms by atomic number, bin z / population_width */
+    int population_width;
+    PopulationSlot population[STATS_SLOTS];
+
+    /* Latency of the instrumented operations, in nanoseconds */
+    LatencySlot latency[STATS_SLOTS];
+
+    /* Atom table: a slab of entries handed out from the free list, or
+     * from the never used ones after atoms_used when the list is empty.
+     * Enumerations stop at atoms_used. */
+    _Atomic uint64_t atoms_free;
+    _Atomic int atoms_used __attribute__((aligned(CACHE_LINE)));
+    AtomIndex atom_index;
+    AtomSlot atoms[ATOM_TABLE_SIZE];
+} Statistics;
+
+
 /* Shared memory operations */
 int create_shared_memory(void);
 Statistics* attach_shared_memory(int shm_id);
 void detach_shared_memory(Statistics* stats);
 void destroy_shared_memory(int shm_id);
+int remove_stale_ipc(void);
 
 /* Semaphore operations */
 int create_semaphores(void);
@@ -73,16 +279,135 @@ void sem_wait_op(int sem_id, int sem_num);
 void sem_signal_op(int sem_id, int sem_num);
 void destroy_semaphores(int sem_id);
 
+/* Ticks of attivatore per second, in real and virtual time */
+#define ACTIVATION_TICKS_PER_SEC 10
+
+/* Activations of the next attivatore tick: ACTIVATION_RATE spread over the
+ * ticks with the rounding kept in carry, or 1-3 when the rate is 0 */
+int activations_for_tick(int* carry, Rng* rng);
+
+/* Number of activations carried by a MSG_SPLIT message */
+#define MSG_ACTIVATIONS(msg) ((msg)->value > 1 ? (msg)->value : 1)
+
 /* Message queue operations */
 int create_message_queue(void);
 int send_message(int msg_id, long mtype, pid_t target_pid, int value);
+int forward_message(int msg_id, const Message* msg, int value);
+int try_send_message(int msg_id, long mtype, pid_t target_pid, int value);
 int receive_message(int msg_id, Message* msg, long mtype);
+long message_queue_depth(int msg_id);
+void init_message_ring(MessageRing* ring);
+void set_message_transport(Statistics* stats, int transport);
 void destroy_message_queue(int msg_id);
 
-/* Utility functions */
-void update_stats_energy(Statistics* stats, int sem_id, long energy);
-void update_stats_split(Statistics* stats, int sem_id);
-void update_stats_waste(Statistics* stats, int sem_id);
-void update_stats_activation(Statistics* stats, int sem_id);
+/* Start barrier and run state (futex based) */
+void signal_init_done(Statistics* stats);
+void wait_for_init(Statistics* stats);
+void wait_for_start(Statistics* stats);
+void start_simulation(Statistics* stats);
+void stop_simulation(Statistics* stats, TerminationCause cause);
+int is_running(Statistics* stats);
+int sleep_while_running(Statistics* stats, long nanoseconds);
+
+/* Sleep while *addr == expected, until woken or until the absolute
+ * CLOCK_MONOTONIC deadline (NULL waits forever) */
+int futex_wait(_Atomic unsigned int* addr, unsigned int expected, const struct timespec* deadline);
+void futex_wake(_Atomic unsigned int* addr, int count);
+int sleep_until_running(Statistics* stats, long deadline_ns);
+
+/* Periodic loop on absolute CLOCK_MONOTONIC deadlines, so the time spent
+ * working in a period does not push the next ones back */
+typedef struct {
+    long next_ns;               /* Deadline of the next period */
+    long period_ns;
+} Schedule;
+
+void schedule_start(Schedule* schedule, long period_ns);
+
+/* Sleep until the next deadline and record how late the wake-up was in
+ * OP_TICK_LAG. Returns the periods to run now: the ones missed as well
+ * with SCHEDULE_POLICY=catchup, one with skip. Returns 0 once the
+ * simulation stopped. */
+int schedule_wait(Statistics* stats, Schedule* schedule);
+
+/* Atom table and targeted activations */
+AtomSlot* atom_table_claim(Statistics* stats, pid_t pid, int atomic_number);
+void atom_table_release(Statistics* stats, AtomSlot* slot);
+int atom_table_used(Statistics* stats);
+
+/* Change the atomic number of a claimed entry, moving it in the index */
+void atom_table_renumber(Statistics* stats, AtomSlot* slot, int atomic_number);
+
+/* Fill targets with up to max registered atoms in O(max) bit scans: the
+ * largest atomic numbers first, or with smallest the smallest numbers
+ * above MIN_N_ATOMICO first (atoms that still split). Atoms in the same
+ * bin come in table order. Returns how many were found. */
+int atom_index_collect(Statistics* stats, int smallest, AtomSlot** targets, int max);
+int deliver_activations(AtomSlot* slot, pid_t pid, int count);
+int wait_for_activation(Statistics* stats, AtomSlot* slot);
+
+/* CLOCK_MONOTONIC time in nanoseconds */
+long monotonic_ns(void);
+
+/* Latency histograms (lock-free, no syscalls) */
+void hist_record(Histogram* h, long ns);
+long hist_percentile(Histogram* h, double percentile);
+void stats_record(Statistics* stats, int op, long ns);
+void stats_latency(Statistics* stats, int op, Histogram* merged);
+void record_activation_latency(Statistics* stats, long sent_ns);
+
+/* Atom process pool */
+void pool_spawned(Statistics* stats, int count);
+int pool_assign(Statistics* stats, int atomic_number);
+int pool_wait_assignment(Statistics* stats);
+int pool_wait_refill(Statistics* stats, int size);
+
+/* Energy released by splitting an atom into n1 and n2 */
+long calculate_energy(int n1, int n2);
+
+/* Energy released by one activation of an atom: the split of split_atom,
+ * or 0 if the atom is waste */
+long activation_yield(int atomic_number);
+
+/* Statistics counters (lock-free, no syscalls) */
+void stats_bind_writer(void);
+void stats_snapshot(Statistics* stats, StatsSnapshot* snap);
+long stats_current_energy(const StatsSnapshot* snap);
+void update_stats_energy(Statistics* stats, long energy);
+void update_stats_consumed(Statistics* stats, long energy);
+void update_stats_split(Statistics* stats);
+void update_stats_waste(Statistics* stats);
+void update_stats_activations(Statistics* stats, long count);
+void update_stats_deferred_atoms(Statistics* stats, long count);
+void update_stats_refused_split(Statistics* stats);
+
+/* Atom population. Every transition is recorded once, by the process (or
+ * engine thread) that owns the atom at that moment: the atom itself when it
+ * starts, splits and exits, the engine for its array entries. */
+void stats_atom_born(Statistics* stats, int atomic_number);
+void stats_atom_split(Statistics* stats, int atomic_number, int remaining);
+void stats_atom_died(Statistics* stats, int atomic_number);
+long stats_atom_count(Statistics* stats);
+void stats_population(Statistics* stats, long counts[POPULATION_BINS]);
+
+/* Reaping of the children of a spawning process. Every process that
+ * forks atoms reaps them as they exit, so dead atoms never hold a pid,
+ * and counts how they exited. */
+void stats_child_exited(Statistics* stats, int status);
+
+/* Reap every exited child without blocking; one SIGCHLD can stand for
+ * many children. Returns how many were reaped. Async-signal-safe. */
+int reap_exited_children(Statistics* stats);
+
+/* Reap from a SIGCHLD handler and unblock SIGCHLD, which a forked or
+ * exec'd process may inherit blocked from the master. Returns 0 on
+ * success, -1 on failure. */
+int install_reaper(Statistics* stats);
+
+/* Bin width covering atomic numbers 0..n_atom_max in POPULATION_BINS bins */
+int population_width_for(int n_atom_max);
+
+/* Energy released by an atom split down to waste, as the atoms split it */
+long split_potential(int atomic_number, int min_n_atomico);
 
 #endif
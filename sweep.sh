@@ -0,0 +1,128 @@
+#!/bin/bash
+
+# Parameter sweep: runs many simulations concurrently and collects the
+# termination cause, duration and final statistics of each one in
+# results.csv.
+#
+# Every SWEEP_<VAR> variable is an axis over the configuration variable
+# <VAR>, as a space-separated list of values (SWEEP_ENERGY_DEMAND="10 50")
+# or, for random sampling, a range (SWEEP_ENERGY_DEMAND=10:200).
+#
+#   SWEEP_SAMPLES    0 runs the full grid of the lists; N runs N random
+#                    configurations, picking a value from each list or range
+#   SWEEP_SEED       seed of the random sampling (default 1)
+#   SWEEP_JOBS       simulations running at once (default: number of CPUs)
+#   SWEEP_MAX_PROCS  no run is started while the user has more processes
+#                    (default: 3/4 of the process limit)
+#   SWEEP_TIMEOUT    seconds after which a run is stopped with SIGTERM, so the
+#                    master still shuts its processes down and removes its
+#                    IPC; SIGKILL follows SWEEP_GRACE seconds later (default
+#                    600, grace 10)
+#   SWEEP_OUT        output directory
+#
+# Variables that are not axes (SIM_DURATION, TRANSPORT, ...) are passed
+# through to every run.
+
+CONTROLS=" SWEEP_SAMPLES SWEEP_SEED SWEEP_JOBS SWEEP_MAX_PROCS SWEEP_TIMEOUT SWEEP_GRACE SWEEP_OUT "
+
+SWEEP_SAMPLES=${SWEEP_SAMPLES:-0}
+SWEEP_JOBS=${SWEEP_JOBS:-$(nproc)}
+SWEEP_TIMEOUT=${SWEEP_TIMEOUT:-600}
+SWEEP_GRACE=${SWEEP_GRACE:-10}
+SWEEP_OUT=${SWEEP_OUT:-sweep_results/$(date +%Y%m%d-%H%M%S)}
+RANDOM=${SWEEP_SEED:-1}
+
+if [ -z "$SWEEP_MAX_PROCS" ]; then
+    limit=$(ulimit -u)
+    if [ "$limit" = "unlimited" ]; then
+        limit=$(cat /proc/sys/kernel/pid_max)
+    fi
+    SWEEP_MAX_PROCS=$((limit * 3 / 4))
+fi
+
+# Axes: the SWEEP_* variables that are not controls
+axes=""
+for name in $(compgen -v SWEEP_); do
+    if [[ "$CONTROLS" != *" $name "* ]]; then
+        axes="$axes ${name#SWEEP_}"
+    fi
+done
+if [ -z "$axes" ]; then
+    echo "No axis: set SWEEP_<VAR>, e.g. SWEEP_ENERGY_DEMAND=\"10 50 100\"" >&2
+    exit 1
+fi
+
+# One line of VAR=value assignments per run
+configs=()
+if [ "$SWEEP_SAMPLES" -gt 0 ]; then
+    for ((n = 0; n < SWEEP_SAMPLES; n++)); do
+        line=""
+        for var in $axes; do
+            spec="SWEEP_$var"
+            spec=${!spec}
+            if [[ "$spec" == *:* ]]; then
+                lo=${spec%%:*}
+                hi=${spec##*:}
+                value=$((lo + (RANDOM * 32768 + RANDOM) % (hi - lo + 1)))
+            else
+                values=($spec)
+                value=${values[RANDOM % ${#values[@]}]}
+            fi
+            line="$line $var=$value"
+        done
+        configs+=("$line")
+    done
+else
+    configs=("")
+    for var in $axes; do
+        spec="SWEEP_$var"
+        grown=()
+        for line in "${configs[@]}"; do
+            for value in ${!spec}; do
+                grown+=("$line $var=$value")
+            done
+        done
+        configs=("${grown[@]}")
+    done
+fi
+
+mkdir -p "$SWEEP_OUT" || exit 1
+echo "Sweep of ${#configs[@]} runs over$axes, $SWEEP_JOBS at a time, into $SWEEP_OUT"
+
+for ((n = 0; n < ${#configs[@]}; n++)); do
+    # Wait for a free job slot and for room under the process budget
+    while [ "$(jobs -rp | wc -l)" -ge "$SWEEP_JOBS" ] ||
+          { [ "$(jobs -rp | wc -l)" -gt 0 ] && [ "$(ps -u "$(id -u)" --no-headers | wc -l)" -gt "$SWEEP_MAX_PROCS" ]; }; do
+        wait -n
+    done
+
+    echo "Run $n:${configs[n]}"
+    (
+        export ${configs[n]}
+        SUMMARY_FILE="$SWEEP_OUT/run-$n.json" timeout -k "$SWEEP_GRACE" "$SWEEP_TIMEOUT" ./master \
+            > "$SWEEP_OUT/run-$n.log" 2>&1
+    ) &
+done
+wait
+
+# Results table: the axes, then the summary of the run. Runs without a
+# summary (crashed or killed) only have their axes and cause FAILED.
+CSV="$SWEEP_OUT/results.csv"
+keys=$(cat "$SWEEP_OUT"/run-*.json 2>/dev/null | head -n 1 | sed 's/[{}"]//g' | tr ',' '\n' | cut -d: -f1 | paste -sd, -)
+echo "run,$(echo $axes | tr ' ' ','),$keys" > "$CSV"
+failed=0
+for ((n = 0; n < ${#configs[@]}; n++)); do
+    row="$n"
+    for assignment in ${configs[n]}; do
+        row="$row,${assignment#*=}"
+    done
+    if [ -s "$SWEEP_OUT/run-$n.json" ]; then
+        row="$row,$(sed 's/[{}"]//g' "$SWEEP_OUT/run-$n.json" | tr ',' '\n' | cut -d: -f2 | paste -sd, -)"
+    else
+        row="$row,FAILED"
+        failed=$((failed + 1))
+    fi
+    echo "$row" >> "$CSV"
+done
+
+echo "Results: $CSV (${#configs[@]} runs, $failed failed)"
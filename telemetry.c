@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "telemetry.h"
+
+#define UNIX_PREFIX "unix:"
+
+static int fd = -1;
+static StatsSnapshot last;
+static long last_ns;
+
+static int connect_unix(const char* path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "telemetry: socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("telemetry socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("telemetry connect");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int telemetry_open(const char* target) {
+    if (strncmp(target, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        fd = connect_unix(target + strlen(UNIX_PREFIX));
+    } else {
+        fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror("telemetry open");
+        }
+    }
+
+    memset(&last, 0, sizeof(last));
+    last_ns = 0;
+    return fd == -1 ? -1 : 0;
+}
+
+/* Write the whole record; a reader that went away disables telemetry */
+static void write_record(const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == ENOTSOCK) {
+            n = write(fd, buf, len);
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("telemetry write");
+            telemetry_close();
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Append to the record; output beyond the buffer is dropped */
+static size_t append(char* buf, size_t used, size_t size, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static size_t append(char* buf, size_t used, size_t size, const char* fmt, ...) {
+    va_list args;
+
+    if (used >= size) {
+        return used;
+    }
+    va_start(args, fmt);
+    int n = vsnprintf(buf + used, size - used, fmt, args);
+    va_end(args);
+    return n < 0 ? used : used + n;
+}
+
+void telemetry_write(Statistics* stats, int msg_id, long elapsed_ns) {
+    char buf[2048];
+    size_t used = 0;
+    StatsSnapshot now;
+
+    if (fd == -1) {
+        return;
+    }
+
+    stats_snapshot(stats, &now);
+    double interval = (elapsed_ns - last_ns) / 1e9;
+    if (interval <= 0) {
+        interval = 1;
+    }
+
+    used = append(buf, used, sizeof(buf), "{\"t\":%.3f,\"running\":%u,\"cause\":%d",
+                  elapsed_ns / 1e9, atomic_load(&stats->running),
+                  atomic_load(&stats->termination_cause));
+    used = append(buf, used, sizeof(buf),
+                  ",\"activations\":%ld,\"splits\":%ld,\"energy_produced\":%ld,\"energy_consumed\":%ld"
+                  ",\"energy\":%ld,\"waste\":%ld,\"num_atoms\":%ld,\"reaped\":%ld"
+                  ",\"exit_failures\":%ld,\"killed\":%ld",
+                  now.activations, now.splits, now.energy_produced, now.energy_consumed,
+                  stats_current_energy(&now), now.waste, now.atoms, now.reaped,
+                  now.exit_failures, now.killed);
+    used = append(buf, used, sizeof(buf),
+                  ",\"processes\":%ld,\"deferred_atoms\":%ld,\"refused_splits\":%ld,\"backlog\":%ld",
+                  atomic_load(&stats->admission.processes), now.deferred_atoms, now.refused_splits,
+                  atomic_load(&stats->admission.backlog));
+    used = append(buf, used, sizeof(buf),
+                  ",\"activations_per_sec\":%.1f,\"splits_per_sec\":%.1f,\"energy_per_sec\":%.1f"
+                  ",\"waste_per_sec\":%.1f",
+                  (now.activations - last.activations) / interval,
+                  (now.splits - last.splits) / interval,
+                  (now.energy_produced - last.energy_produced) / interval,
+                  (now.waste - last.waste) / interval);
+    used = append(buf, used, sizeof(buf),
+                  ",\"queue_depth\":%ld,\"queue_peak\":%ld,\"send_failures\":%ld,\"pool_available\":%u",
+                  message_queue_depth(msg_id), atomic_load(&stats->queue_peak),
+                  atomic_load(&stats->send_failures), atomic_load(&stats->pool.available) & ~FUTEX_STOPPED);
+
+    for (int op = 0; op < NUM_OPS; op++) {
+        Histogram h;
+        stats_latency(stats, op, &h);
+        used = append(buf, used, sizeof(buf),
+                      ",\"%s_count\":%ld,\"%s_p50_ns\":%ld,\"%s_p99_ns\":%ld,\"%s_max_ns\":%ld",
+                      stats_op_names[op], h.count, stats_op_names[op], hist_percentile(&h, 50),
+                      stats_op_names[op], hist_percentile(&h, 99), stats_op_names[op], h.max);
+    }
+    used = append(buf, used, sizeof(buf), "}\n");
+
+    if (used >= sizeof(buf)) {
+        fprintf(stderr, "telemetry: record truncated\n");
+        return;
+    }
+    write_record(buf, used);
+
+    last = now;
+    last_ns = elapsed_ns;
+}
+
+void telemetry_close(void) {
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "shared.h"
+
+/*
+ * Streaming telemetry of the master (TELEMETRY).
+ *
+ * Every TELEMETRY_MS the master writes one JSON object per line with the
+ * counters of the shared segment, the rates since the previous record and
+ * the latency percentiles, to a file or, for "unix:<path>", to a listening
+ * Unix stream socket. Records are built from lock-free snapshots, so no
+ * lock is held while writing.
+ */
+
+/* Open the telemetry target. Returns 0 on success, -1 on failure. */
+int telemetry_open(const char* target);
+
+/* Write one record; elapsed_ns is the time since the start of the run */
+void telemetry_write(Statistics* stats, int msg_id, long elapsed_ns);
+
+/* Close the target. Safe to call when it was never opened. */
+void telemetry_close(void);
+
+#endif